@@ -0,0 +1,190 @@
+/*
+ * Microbenchmarks for the bitboard kernels.
+ * Collects positions from pseudo-random games, then times every available
+ * implementation of legal-move generation and of flipping on those positions.
+ * Usage: ./bench [repetitions]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "kernels.hh"
+#include "moves.hh"
+#include "playouts.hh"
+#include "random_games.hh"
+#include "random_player.hh"
+
+using namespace Othello;
+using namespace std;
+
+// A position to benchmark, with all its legal moves and one of them:
+struct Position {
+  bits_t mine_, theirs_, moves_, move_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Play random games from the initial board, collecting every legal move of
+// every position encountered.
+vector<Position>
+collect_positions(unsigned ngames)
+{
+  vector<Position> ret;
+  Xoshiro256 rng(1);
+  play_random_games(ngames, rng, [&](bits_t mine, bits_t theirs, bits_t moves) {
+    for (bits_t left = moves; left; left &= left - 1) {
+      ret.push_back({ mine, theirs, moves, left & -left });
+    }
+  });
+  return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Time repeated calls of f over all positions and report ns per call:
+template <typename F>
+void
+time_kernel(const string& name, const vector<Position>& positions, unsigned reps, F f)
+{
+  bits_t sink = 0;
+  const auto begin = chrono::steady_clock::now();
+  for (unsigned r = 0; r < reps; ++r) {
+    for (const auto& p : positions) {
+      sink += f(p);
+    }
+  }
+  const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - begin;
+
+  cout << setw(24) << left << name << fixed << setprecision(2) <<
+    elapsed.count() / (double(reps) * positions.size()) << " ns/call" <<
+    "  (checksum " << hex << sink << dec << ")\n";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Time repeated calls of a batched f over n boards and report ns per board:
+template <typename F>
+void
+time_batch(const string& name, size_t n, unsigned reps, F f)
+{
+  bits_t sink = 0;
+  const auto begin = chrono::steady_clock::now();
+  for (unsigned r = 0; r < reps; ++r) {
+    sink += f();
+  }
+  const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - begin;
+
+  cout << setw(24) << left << name << fixed << setprecision(2) <<
+    elapsed.count() / (double(reps) * n) << " ns/board" <<
+    "  (checksum " << hex << sink << dec << ")\n";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Time f, which plays ngames random games and returns how many dark won,
+// and report (and return) games per second:
+template <typename F>
+double
+time_playouts(const string& name, unsigned ngames, F f)
+{
+  const auto begin = chrono::steady_clock::now();
+  const auto dark_wins = f();
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+  const double rate = ngames / elapsed.count();
+
+  cout << setw(24) << left << name << fixed << setprecision(0) << rate <<
+    " playouts/s" << "  (dark won " << setprecision(1) <<
+    100. * dark_wins / ngames << "%)\n" << setprecision(2);
+  return rate;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[])
+{
+  const unsigned reps = (argc > 1)? atoi(argv[1]) : 20;
+  const auto positions = collect_positions(2000);
+  cout << "Benchmarking " << positions.size() << " positions x " << reps << " repetitions\n";
+
+  cout << "\nLegal move generation:\n";
+  time_kernel("fsm", positions, reps,
+      [](const Position& p) { return all_legal_moves_fsm(p.mine_, p.theirs_); });
+  time_kernel("fill", positions, reps,
+      [](const Position& p) { return all_legal_moves_fill(p.mine_, p.theirs_); });
+  for (const auto kernels : supported_kernels()) {
+    time_kernel(kernels->name_, positions, reps,
+        [&](const Position& p) { return kernels->legal_moves_(p.mine_, p.theirs_); });
+  }
+
+  cout << "\nFlipped pieces:\n";
+  time_kernel("scan (find_flipped)", positions, reps,
+      [](const Position& p) { return all_flipped_scan(p.mine_, p.theirs_, p.move_); });
+  time_kernel("fill", positions, reps,
+      [](const Position& p) { return all_flipped_fill(p.mine_, p.theirs_, p.move_); });
+  for (const auto kernels : supported_kernels()) {
+    time_kernel(kernels->name_, positions, reps,
+        [&](const Position& p) { return kernels->flipped_(p.mine_, p.theirs_, p.move_); });
+  }
+
+  cout << "\nRandom move selection:\n";
+  for (const auto kernels : supported_kernels()) {
+    time_kernel(kernels->name_, positions, reps,
+        [&](const Position& p) { return kernels->select_move_(p.moves_, p.mine_ * p.theirs_); });
+  }
+
+  cout << "\nBatched legal moves and moves (per board):\n";
+  BoardBatch batch;
+  vector<bits_t> moves;
+  for (const auto& p : positions) {
+    batch.push_back(Board(p.mine_, p.theirs_));
+    moves.push_back(p.move_);
+  }
+  vector<bits_t> out(batch.size());
+  for (const auto kernels : supported_kernels()) {
+    time_batch(string(kernels->name_) + " legal", batch.size(), reps, [&]() {
+        kernels->legal_moves_batch_(batch.dark(), batch.light(), out.data(), batch.size());
+        return out[0];
+        });
+  }
+  for (const auto kernels : supported_kernels()) {
+    // Every move is legal on the original batch only, so effect them on a copy:
+    time_batch(string(kernels->name_) + " effect", batch.size(), reps, [&]() {
+        BoardBatch copy = batch;
+        kernels->effect_move_batch_(copy.dark(), copy.light(), moves.data(), copy.size());
+        return copy.dark()[0];
+        });
+  }
+
+  cout << "\nRandom playouts from the initial board:\n";
+  const Board initial(setpos(3, 3) | setpos(4, 4), setpos(3, 4) | setpos(4, 3));
+  const unsigned ngames = 2000 * reps;
+  const auto serial_rate = time_playouts("play_game", ngames, [&]() {
+      const RandomPlayer dark(Color::DARK, 1), light(Color::LIGHT, 2);
+      int sum = 0;
+      for (unsigned g = 0; g < ngames; ++g) {
+        sum += play_game(initial, &dark, &light) > 0;
+      }
+      return sum;
+      });
+  const auto loop_rate = time_playouts("playout", ngames, [&]() {
+      RandomPolicy policy(Xoshiro256(1));
+      int sum = 0;
+      for (unsigned g = 0; g < ngames; ++g) {
+        sum += playout(initial, Color::DARK, policy) > 0;
+      }
+      return sum;
+      });
+  cout << setw(24) << "" << loop_rate / serial_rate << "x play_game\n";
+  for (const auto kernels : supported_kernels()) {
+    const auto rate = time_playouts(string(kernels->name_) + " lanes", ngames, [&]() {
+        PlayoutEngine engine(Xoshiro256(1), *kernels);
+        int sum = 0;
+        unsigned played = 0;
+        engine.run([&]() { return Playout{ initial, Color::DARK, 0 }; },
+                   [&](unsigned, int diff, PlayedMoves) { sum += diff > 0; return ++played < ngames; });
+        return sum;
+        });
+    cout << setw(24) << "" << rate / serial_rate << "x play_game\n";
+  }
+
+  return 0;
+}
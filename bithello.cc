@@ -7,6 +7,7 @@
  */
 
 #include <cassert>
+#include <cctype>
 #include <chrono>
 #include <cstring>
 #include <climits>
@@ -15,6 +16,7 @@
 #include <memory>
 
 #include "board.hh"
+#include "kernels.hh"
 #include "moves.hh"
 #include "mcts_player.hh"
 #include "random_player.hh"
@@ -44,13 +46,60 @@ void help(const char* pname)
     "\t\t -m [number]: how many moves to evaluate for each turn (default: " <<
     DEFAULT_MOVES << ")\n" <<
     "\t\t -t [number]: how many milliseconds to evaluate in each turn\n" <<
+    "\t\t -T [total[+inc]]: a game clock of total milliseconds, plus inc\n" <<
+    "\t\t    after each move, spread over the moves by game phase\n" <<
+    "\t\t -e [number]: stop a turn early once the best move is sure: it's\n" <<
+    "\t\t    forced, can't be overtaken within -m, or its win rate leads\n" <<
+    "\t\t    every other move's by this many standard errors (default: off)\n" <<
+    "\t\t -c [number]: UCB1 exploration constant (default: " <<
+    MCTSConfig().exploration_ << ")\n" <<
+    "\t\t -r [number]: RAVE equivalence parameter, the visits at which a\n" <<
+    "\t\t    move's all-moves-as-first statistics weigh as much as its own\n" <<
+    "\t\t    (default: " << MCTSConfig().rave_ << ", 0 disables them)\n" <<
+    "\t\t -s [number]: back up playout scores instead of wins: the outcome,\n" <<
+    "\t\t    blended with the tile margin by this weight in [0, 1]\n" <<
+    "\t\t    (default: off)\n" <<
+    "\t\t -b [ucb1|thompson|halving]: how the root's moves are picked:\n" <<
+    "\t\t    by UCB1, by Thompson sampling, or by sequential halving of\n" <<
+    "\t\t    the -m budget (default: ucb1)\n" <<
+    "\t\t -p [tree|root]: threads search one shared tree, or a tree each\n" <<
+    "\t\t    whose root statistics are summed (default: tree)\n" <<
+    "\t\t -M [size]: memory for the search trees, in MB or with a K/M/G\n" <<
+    "\t\t    suffix, e.g., 512MB; the least visited nodes are pruned\n" <<
+    "\t\t    when it runs out (default: " << (MCTSConfig().max_memory_ >> 20) << "MB)\n" <<
+    "\t\t -x [on|off]: share the statistics of positions reached by\n" <<
+    "\t\t    different move orders (default: off)\n" <<
     "All player types can be abbreviated to unique prefix.\n" <<
+    "Alternatively, -k by itself reports the move kernels active on this CPU.\n" <<
     "Example: start a game with first player human, second player easy MCTS:\n" <<
     "\t" << pname << " -d text -l mcts -m 100" <<
     endl;
   exit(-2);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Parse a memory size such as 512MB, 2G, or 300 (MB by default).
+// Returns zero for any parsing error.
+uint64_t
+parse_size(const char* arg)
+{
+  char* suffix;
+  const uint64_t size = strtoull(arg, &suffix, 10);
+  if (suffix == arg) {
+    return 0;
+  }
+  unsigned shift = 20;
+  switch (toupper(*suffix)) {
+    case 'K': shift = 10; ++suffix; break;
+    case 'M': shift = 20; ++suffix; break;
+    case 'G': shift = 30; ++suffix; break;
+  }
+  if (toupper(*suffix) == 'B') {
+    ++suffix;
+  }
+  return *suffix? 0 : size << shift;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //  Parse a set of command line arguments to extract a type of player+arguments,
 //  and allocate a new player of this type.
@@ -73,27 +122,106 @@ parse_player_options(Color color, int& argc, char**& argv)
 
   if (MCTS_STR.find(type) == 0) {
   // If the player is MCTS, we need to parse more optional arguments:
-    if (argc && !strcmp(*argv, "-m")) {
-      ++argv; -- argc;
-      uint64_t moves;
-      if (!argc-- || (moves = atoll(*argv++)) < 1) {
+    MCTSConfig config;
+    stopper = shared_ptr<StopCondition>(new StopByMoves(DEFAULT_MOVES));
+    double confidence = 0;
+
+    while (argc && **argv == '-' && strcmp(*argv, "-d") && strcmp(*argv, "-l")) {
+      const string opt(*argv++);
+      --argc;
+      if (!argc--) {
         return nullptr;
       }
-      stopper = shared_ptr<StopCondition>(new StopByMoves(moves));
+      const char* arg = *argv++;
+
+      if (opt == "-m") {
+        uint64_t moves;
+        if ((moves = atoll(arg)) < 1) {
+          return nullptr;
+        }
+        stopper = shared_ptr<StopCondition>(new StopByMoves(moves));
+
+      } else if (opt == "-t") {
+        uint64_t duration;
+        if ((duration = atoll(arg)) < 1) {
+          return nullptr;
+        }
+        stopper = shared_ptr<StopCondition>(new StopByDuration(chrono::milliseconds(duration)));
+
+      } else if (opt == "-T") {
+        char* inc;
+        const uint64_t total = strtoull(arg, &inc, 10);
+        const uint64_t increment = (*inc == '+')? strtoull(inc + 1, &inc, 10) : 0;
+        if (total < 1 || *inc) {
+          return nullptr;
+        }
+        stopper = shared_ptr<StopCondition>(new StopByClock(StopByClock::duration_t(total),
+                                                            StopByClock::duration_t(increment)));
+
+      } else if (opt == "-e") {
+        if ((confidence = atof(arg)) <= 0) {
+          return nullptr;
+        }
 
-    } else if (argc && !strcmp(*argv, "-t")) {
-      ++argv; -- argc;
-      uint64_t duration;
-      if (!argc-- || (duration = atoll(*argv++)) < 1) {
+      } else if (opt == "-c") {
+        if ((config.exploration_ = atof(arg)) < 0) {
+          return nullptr;
+        }
+
+      } else if (opt == "-r") {
+        if ((config.rave_ = atof(arg)) < 0) {
+          return nullptr;
+        }
+
+      } else if (opt == "-s") {
+        config.scores_ = true;
+        if ((config.margin_ = atof(arg)) < 0 || config.margin_ > 1) {
+          return nullptr;
+        }
+
+      } else if (opt == "-b") {
+        if (!strcmp(arg, "ucb1")) {
+          config.root_ = RootPolicy::UCB1;
+        } else if (!strcmp(arg, "thompson")) {
+          config.root_ = RootPolicy::THOMPSON;
+        } else if (!strcmp(arg, "halving")) {
+          config.root_ = RootPolicy::HALVING;
+        } else {
+          return nullptr;
+        }
+
+      } else if (opt == "-p") {
+        if (!strcmp(arg, "tree")) {
+          config.parallel_ = Parallelism::TREE;
+        } else if (!strcmp(arg, "root")) {
+          config.parallel_ = Parallelism::ROOT;
+        } else {
+          return nullptr;
+        }
+
+      } else if (opt == "-M") {
+        if ((config.max_memory_ = parse_size(arg)) < (1 << 20)) {
+          return nullptr;
+        }
+
+      } else if (opt == "-x") {
+        if (!strcmp(arg, "on")) {
+          config.transpositions_ = true;
+        } else if (!strcmp(arg, "off")) {
+          config.transpositions_ = false;
+        } else {
+          return nullptr;
+        }
+
+      } else {
         return nullptr;
       }
-      stopper = shared_ptr<StopCondition>(new StopByDuration(chrono::milliseconds(duration)));
-
-    } else {
-      stopper = shared_ptr<StopCondition>(new StopByMoves(DEFAULT_MOVES));
     }
 
-    return new MCTSPlayer(color, stopper);
+    if (confidence > 0) {
+      stopper = shared_ptr<StopCondition>(new StopByConfidence(stopper, confidence));
+    }
+    return new MCTSPlayer(color, stopper, config);
   }
 
   return nullptr;
@@ -110,6 +238,12 @@ parse_command_line(int argc, char* argv[])
   const auto pname = argv[0];
   argv++; argc--;
 
+  if (argc == 1 && string(*argv) == "-k") {
+    cout << "Active move kernels: " << active_kernels().name_ <<
+      " (best supported: " << kernels_for(best_isa()).name_ << ")" << endl;
+    exit(0);
+  }
+
   if (argc < 4) {
     help(pname);
   }
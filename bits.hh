@@ -28,7 +28,7 @@ constexpr bits_t ONE(1);
 
 // Translate row/col position into bit index and vise versa:
 constexpr idx_t pos2bit(idx_t row, idx_t col) { return row * N + col; }
-constexpr idx_t pos2bit(bits_t pos) { return __builtin_ffs(pos) - 1; }
+constexpr idx_t pos2bit(bits_t pos) { return __builtin_ffsll(pos) - 1; }
 constexpr idx_t bit2col(idx_t pos) { return pos % N; }
 constexpr idx_t bit2row(idx_t pos) { return pos / N; }
 
@@ -46,6 +46,71 @@ constexpr bits_t clear(bits_t bits, idx_t row, idx_t col) { return clear(bits, p
 // Total count of set bits:
 constexpr idx_t bits_set(bits_t bits) { return __builtin_popcountll(bits); }
 
+// Map the high 32 bits of a random word onto [0, count), uniformly (up to a
+// bias of count / 2^32) with a multiply and a shift instead of a division:
+constexpr idx_t random_below(uint64_t rnd, idx_t count) { return ((rnd >> 32) * count) >> 32; }
+
+// Prefix population counts by byte: byte i holds the number of bits set in
+// bytes 0 to i of bits, so the top byte is the total count.
+constexpr bits_t
+byte_prefix_counts(bits_t bits)
+{
+  // (Not the textbook SWAR popcount, which GCC turns into a popcnt that it
+  // then can't vectorize.)
+  bits_t counts = (bits & 0x5555555555555555) + ((bits >> 1) & 0x5555555555555555);
+  counts = (counts & 0x3333333333333333) + ((counts >> 2) & 0x3333333333333333);
+  counts = (counts & 0x0F0F0F0F0F0F0F0F) + ((counts >> 4) & 0x0F0F0F0F0F0F0F0F);
+  counts += counts << 8;
+  counts += counts << 16;
+  return counts + (counts << 32);
+}
+
+// The n-th lowest set bit (from zero) of bits as a bitmap, or zero if fewer
+// than n + 1 bits are set, given byte_prefix_counts(bits). This is the
+// portable equivalent of _pdep_u64(ONE << n, bits): no branches, lookups,
+// variable shifts or popcnt, so it also vectorizes across many bitmaps.
+constexpr bits_t
+nth_set_bit(bits_t bits, bits_t counts, idx_t n)
+{
+  constexpr bits_t HIGHS = 0x8080808080808080;
+  constexpr bits_t LOWS = 0x0101010101010101;
+  assert(n < N2);
+
+  // n in every byte, and a high bit in every byte whose prefix count is at
+  // most n, i.e., every byte below the one that holds the n-th set bit:
+  bits_t ns = n;
+  ns |= ns << 8;
+  ns |= ns << 16;
+  ns |= ns << 32;
+  const bits_t below = ((ns | HIGHS) - counts) & HIGHS;
+
+  // Mask of that byte (the lowest byte that isn't below), if any:
+  const bits_t after = (below << 1) - (below >> 7) + 1;
+  const bits_t byte = (after << 8) - after;
+
+  // Clear the lower set bits in that byte, skipping the ones counted before
+  // it, with the skip count and a running threshold both kept in the byte:
+  const bits_t skip = (ns - (counts << 8)) & byte;
+  bits_t left = bits & byte;
+  bits_t threshold = 0;
+#pragma GCC unroll 8  // Straight-line code, to vectorize the callers' loops
+  for (idx_t i = 0; i < N - 1; ++i) {
+    left &= left - (left & -left & -bits_t(threshold < skip));
+    threshold += byte & LOWS;
+  }
+  return left & -left;
+}
+
+constexpr bits_t nth_set_bit(bits_t bits, idx_t n) { return nth_set_bit(bits, byte_prefix_counts(bits), n); }
+
+// A uniformly random set bit of bits (or zero if there are none):
+constexpr bits_t
+random_set_bit(bits_t bits, uint64_t rnd)
+{
+  const bits_t counts = byte_prefix_counts(bits);
+  return nth_set_bit(bits, counts, random_below(rnd, counts >> (N2 - N)));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Generic concept for anything that supports some parallel bitwise operations.
 template <typename T>
@@ -24,6 +24,8 @@ class Board {
   ~Board() = default;
   Board(const Board&) = default;
   Board(Board&&) = default;
+  Board& operator=(const Board&) = default;
+  Board() = default; // Uninitialized, unless value-initialized (Board{})
   constexpr Board(bits_t dark, bits_t light) : dark_(dark), light_(light) {}
 
   // Initialize a board from rows: strings of optional dark/light pieces
@@ -51,8 +53,37 @@ class Board {
   // Given a vector of row strings, return a bitmap to all positions in all rows
   // that have the given symbol in the string position.
   bits_t mark_bits(const std::vector<std::string>& rows, char symbol) const;
-  const bits_t dark_;
-  const bits_t light_;
+  bits_t dark_;
+  bits_t light_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// A batch of boards, stored as two contiguous arrays ("structure of arrays"):
+// one with the dark bitmaps of all boards, and one with the light bitmaps.
+// This layout lets batched move functions load consecutive boards straight
+// into the lanes of vector registers.
+class BoardBatch {
+ public:
+  BoardBatch() = default;
+  explicit BoardBatch(size_t size) : dark_(size), light_(size) {}
+  ~BoardBatch() = default;
+
+  size_t size() const { return dark_.size(); }
+  void resize(size_t size) { dark_.resize(size); light_.resize(size); }
+  void push_back(Board b) { dark_.push_back(b.dark()); light_.push_back(b.light()); }
+
+  Board operator[](size_t i) const { return Board(dark_[i], light_[i]); }
+  void set(size_t i, Board b) { dark_[i] = b.dark(); light_[i] = b.light(); }
+
+  const bits_t* dark() const { return dark_.data(); }
+  const bits_t* light() const { return light_.data(); }
+  bits_t* dark() { return dark_.data(); }
+  bits_t* light() { return light_.data(); }
+
+ private:
+  std::vector<bits_t> dark_;
+  std::vector<bits_t> light_;
 };
 
 
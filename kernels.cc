@@ -0,0 +1,500 @@
+/*
+ * Implementations of the bitboard kernels for each instruction-set level,
+ * and the CPU detection that picks among them.
+ *
+ * The x86 kernels are compiled with per-function target attributes, so the
+ * rest of the program can be built for a portable baseline architecture.
+ * They're all occluded fills (see fill_legal_moves in moves.hh), vectorized
+ * by packing different scan directions into the lanes of one register.
+ */
+
+#include "kernels.hh"
+#include "moves.hh"
+#include "playouts.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define X86_KERNELS
+#  include <immintrin.h>
+#endif
+
+namespace Othello {
+
+////////////////////////////////////////////////////////////////////////////////
+// Portable kernels
+
+// Picks a uniformly random move: draws an index below the number of moves,
+// and finds the move with that index in constant time (see nth_set_bit).
+static bits_t
+select_move_uniform(bits_t moves, uint64_t rnd)
+{
+  assert(moves);
+  return random_set_bit(moves, rnd);
+}
+
+// Batched kernels: loops over the occluded fills, which are free of branches
+// and table lookups, so the compiler vectorizes them across boards. They're
+// always inlined into per-target wrappers, to vectorize for each vector width.
+__attribute__((always_inline))
+static inline void
+legal_moves_loop(const bits_t* mine, const bits_t* theirs, bits_t* moves, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    moves[i] = all_legal_moves_fill(mine[i], theirs[i]);
+  }
+}
+
+__attribute__((always_inline))
+static inline void
+effect_move_loop(bits_t* mine, bits_t* theirs, const bits_t* pos, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    const bits_t flipped = all_flipped_fill(mine[i], theirs[i], pos[i]);
+    mine[i] ^= flipped | pos[i];
+    theirs[i] ^= flipped;
+  }
+}
+
+// One ply in every lane: the player to move plays a random legal move (or
+// passes), which is recorded if it's dark's, and then the two sides swap. Moves are picked (with select) in a
+// separate pass, which vectorizes if select does, and otherwise only that
+// pass runs one lane at a time. The next ply's random words are drawn ahead,
+// in the vectorized last pass, so they're never on the critical path.
+template <bits_t (*select)(bits_t moves, uint64_t rnd)>
+__attribute__((always_inline))
+static inline void
+playout_ply_loop(PlayoutLanes& lanes)
+{
+  bits_t moves[PLAYOUT_LANES], pos[PLAYOUT_LANES];
+  for (unsigned i = 0; i < PLAYOUT_LANES; ++i) {
+    moves[i] = all_legal_moves_fill(lanes.mine_[i], lanes.theirs_[i]);
+  }
+  for (unsigned i = 0; i < PLAYOUT_LANES; ++i) {
+    pos[i] = select(moves[i], lanes.rnd_[i]);
+  }
+
+  for (unsigned i = 0; i < PLAYOUT_LANES; ++i) {
+    const bits_t mine = lanes.mine_[i];
+    const bits_t theirs = lanes.theirs_[i];
+    const bits_t flipped = all_flipped_fill(mine, theirs, pos[i]);
+
+    lanes.mine_[i] = theirs ^ flipped;
+    lanes.theirs_[i] = mine ^ flipped ^ pos[i];
+    lanes.dark_moves_[i] |= pos[i] & lanes.dark_[i];
+    lanes.dark_[i] = ~lanes.dark_[i];
+    lanes.passes_[i] = (lanes.passes_[i] + 1) & -uint64_t(!moves[i]);
+
+    lanes.rnd_[i] = lanes.rng_.next(i);
+  }
+}
+
+static void
+legal_moves_batch(const bits_t* mine, const bits_t* theirs, bits_t* moves, size_t n)
+{
+  legal_moves_loop(mine, theirs, moves, n);
+}
+
+static void
+effect_move_batch(bits_t* mine, bits_t* theirs, const bits_t* pos, size_t n)
+{
+  effect_move_loop(mine, theirs, pos, n);
+}
+
+static void
+playout_ply(PlayoutLanes& lanes)
+{
+  playout_ply_loop<random_set_bit>(lanes);
+}
+
+#ifdef X86_KERNELS
+////////////////////////////////////////////////////////////////////////////////
+// BMI kernels
+
+// Same choice as select_move_uniform, but deposits the index-th set bit of
+// the moves with a single pdep.
+__attribute__((target("bmi,bmi2,popcnt")))
+static inline bits_t
+select_pdep(bits_t moves, uint64_t rnd)
+{
+  return _pdep_u64(ONE << random_below(rnd, bits_set(moves)), moves);
+}
+
+__attribute__((target("bmi,bmi2,popcnt")))
+static bits_t
+select_move_pdep(bits_t moves, uint64_t rnd)
+{
+  assert(moves);
+  return select_pdep(moves, rnd);
+}
+
+// Table-driven flips (see LINE_MASKS in moves.hh): for each of the four lines
+// through the move, extract the line's pieces, look up the outflanking pieces
+// and then the flipped ones, and deposit those back on the board. That's a
+// fixed number of table loads, with no data-dependent branches.
+__attribute__((target("bmi,bmi2")))
+static bits_t
+flipped_pext(bits_t mine, bits_t theirs, bits_t pos)
+{
+  const idx_t bit = __builtin_ctzll(pos);
+  bits_t ret = 0;
+
+  for (idx_t line = 0; line < NLINES; ++line) {
+    const bits_t mask = LINE_MASKS[bit][line];
+    const idx_t x = LINE_INDICES[bit][line];
+    const idx_t inner = (_pext_u64(theirs, mask) >> 1) & (LINE_OUTFLANKS[x].size() - 1);
+    const idx_t outflank = LINE_OUTFLANKS[x][inner] & _pext_u64(mine, mask);
+    ret |= _pdep_u64(LINE_FLIPS[x][outflank], mask);
+  }
+  return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2 kernels: the four directions that shift towards the MSB share one
+// register, and the four that shift towards the LSB share another.
+
+alignas(32) static constexpr bits_t AVX2_SHIFTS[] = { N + 1, N - 1, N, 1 };
+alignas(32) static constexpr bits_t AVX2_LMASKS[] = {
+    reachable(TL2BR), reachable(TR2BL), reachable(T2B), reachable(L2R) };
+alignas(32) static constexpr bits_t AVX2_RMASKS[] = {
+    reachable(BR2TL), reachable(BL2TR), reachable(B2T), reachable(R2L) };
+
+// Occluded fill of gen through pro (already masked to reachable positions)
+// in the four directions of both registers at once.
+__attribute__((target("avx2"), always_inline))
+static inline void
+fill_avx2(__m256i& lgen, __m256i& rgen, __m256i lpro, __m256i rpro)
+{
+  const __m256i shift1 = _mm256_load_si256((const __m256i*)AVX2_SHIFTS);
+  const __m256i shift2 = _mm256_add_epi64(shift1, shift1);
+  const __m256i shift4 = _mm256_add_epi64(shift2, shift2);
+
+  lgen = _mm256_or_si256(lgen, _mm256_and_si256(lpro, _mm256_sllv_epi64(lgen, shift1)));
+  rgen = _mm256_or_si256(rgen, _mm256_and_si256(rpro, _mm256_srlv_epi64(rgen, shift1)));
+  lpro = _mm256_and_si256(lpro, _mm256_sllv_epi64(lpro, shift1));
+  rpro = _mm256_and_si256(rpro, _mm256_srlv_epi64(rpro, shift1));
+  lgen = _mm256_or_si256(lgen, _mm256_and_si256(lpro, _mm256_sllv_epi64(lgen, shift2)));
+  rgen = _mm256_or_si256(rgen, _mm256_and_si256(rpro, _mm256_srlv_epi64(rgen, shift2)));
+  lpro = _mm256_and_si256(lpro, _mm256_sllv_epi64(lpro, shift2));
+  rpro = _mm256_and_si256(rpro, _mm256_srlv_epi64(rpro, shift2));
+  lgen = _mm256_or_si256(lgen, _mm256_and_si256(lpro, _mm256_sllv_epi64(lgen, shift4)));
+  rgen = _mm256_or_si256(rgen, _mm256_and_si256(rpro, _mm256_srlv_epi64(rgen, shift4)));
+}
+
+// OR together the four lanes of a register:
+__attribute__((target("avx2"), always_inline))
+static inline bits_t
+reduce_or_avx2(__m256i v)
+{
+  const __m128i half = _mm_or_si128(_mm256_castsi256_si128(v),
+                                    _mm256_extracti128_si256(v, 1));
+  return _mm_cvtsi128_si64(half) | _mm_extract_epi64(half, 1);
+}
+
+// Same steps as fill_legal_moves, four directions per register.
+__attribute__((target("avx2,bmi,bmi2")))
+static bits_t
+legal_moves_avx2(bits_t mine, bits_t theirs)
+{
+  const __m256i shift1 = _mm256_load_si256((const __m256i*)AVX2_SHIFTS);
+  const __m256i lmask = _mm256_load_si256((const __m256i*)AVX2_LMASKS);
+  const __m256i rmask = _mm256_load_si256((const __m256i*)AVX2_RMASKS);
+  const __m256i t = _mm256_set1_epi64x(theirs);
+
+  __m256i lgen = _mm256_set1_epi64x(mine);
+  __m256i rgen = lgen;
+  fill_avx2(lgen, rgen, _mm256_and_si256(t, lmask), _mm256_and_si256(t, rmask));
+
+  // Positions right after a filled opponent piece, still on the same line:
+  const __m256i lvalid = _mm256_and_si256(lmask,
+      _mm256_sllv_epi64(_mm256_and_si256(lgen, t), shift1));
+  const __m256i rvalid = _mm256_and_si256(rmask,
+      _mm256_srlv_epi64(_mm256_and_si256(rgen, t), shift1));
+  return reduce_or_avx2(_mm256_or_si256(lvalid, rvalid)) & ~(mine | theirs);
+}
+
+// Same steps as fill_flipped, four directions per register.
+__attribute__((target("avx2,bmi,bmi2")))
+static bits_t
+flipped_avx2(bits_t mine, bits_t theirs, bits_t pos)
+{
+  const __m256i shift1 = _mm256_load_si256((const __m256i*)AVX2_SHIFTS);
+  const __m256i lmask = _mm256_load_si256((const __m256i*)AVX2_LMASKS);
+  const __m256i rmask = _mm256_load_si256((const __m256i*)AVX2_RMASKS);
+  const __m256i m = _mm256_set1_epi64x(mine);
+  const __m256i t = _mm256_set1_epi64x(theirs);
+  const __m256i zero = _mm256_setzero_si256();
+
+  __m256i lgen = _mm256_set1_epi64x(pos);
+  __m256i rgen = lgen;
+  fill_avx2(lgen, rgen, _mm256_and_si256(t, lmask), _mm256_and_si256(t, rmask));
+
+  // A run of filled opponent pieces is flipped only if mine comes next:
+  const __m256i lout = _mm256_and_si256(_mm256_and_si256(m, lmask),
+                                        _mm256_sllv_epi64(lgen, shift1));
+  const __m256i rout = _mm256_and_si256(_mm256_and_si256(m, rmask),
+                                        _mm256_srlv_epi64(rgen, shift1));
+  const __m256i lflip = _mm256_andnot_si256(_mm256_cmpeq_epi64(lout, zero),
+                                            _mm256_and_si256(lgen, t));
+  const __m256i rflip = _mm256_andnot_si256(_mm256_cmpeq_epi64(rout, zero),
+                                            _mm256_and_si256(rgen, t));
+  return reduce_or_avx2(_mm256_or_si256(lflip, rflip));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX-512 kernels: all eight directions share one register. Shifts towards
+// the LSB become left rotations by N2 minus the shift count. The bits that
+// wrap around always land on positions outside the reachable mask of their
+// direction, so they're discarded just like the bits shifted out.
+
+alignas(64) static constexpr bits_t AVX512_ROTATES[] = {
+    N + 1, N - 1, N, 1, N2 - N - 1, N2 - N + 1, N2 - N, N2 - 1 };
+alignas(64) static constexpr bits_t AVX512_MASKS[] = {
+    reachable(TL2BR), reachable(TR2BL), reachable(T2B), reachable(L2R),
+    reachable(BR2TL), reachable(BL2TR), reachable(B2T), reachable(R2L) };
+
+// Per-lane left rotation and lane reduction. These use the zero-masked forms
+// of the intrinsics, because the unmasked ones trip -Wuninitialized in gcc.
+__attribute__((target("avx512f"), always_inline))
+static inline __m512i
+rolv_avx512(__m512i v, __m512i counts)
+{
+  return _mm512_maskz_rolv_epi64(0xFF, v, counts);
+}
+
+__attribute__((target("avx512f,avx2"), always_inline))
+static inline bits_t
+reduce_or_avx512(__m512i v)
+{
+  return reduce_or_avx2(_mm256_or_si256(_mm512_maskz_extracti64x4_epi64(0xF, v, 0),
+                                        _mm512_maskz_extracti64x4_epi64(0xF, v, 1)));
+}
+
+// Occluded fill of gen through pro in all eight directions at once:
+__attribute__((target("avx512f"), always_inline))
+static inline __m512i
+fill_avx512(__m512i gen, __m512i pro)
+{
+  const __m512i mod = _mm512_set1_epi64(N2 - 1);
+  const __m512i rot1 = _mm512_load_si512(AVX512_ROTATES);
+  const __m512i rot2 = _mm512_and_si512(_mm512_add_epi64(rot1, rot1), mod);
+  const __m512i rot4 = _mm512_and_si512(_mm512_add_epi64(rot2, rot2), mod);
+
+  gen = _mm512_or_si512(gen, _mm512_and_si512(pro, rolv_avx512(gen, rot1)));
+  pro = _mm512_and_si512(pro, rolv_avx512(pro, rot1));
+  gen = _mm512_or_si512(gen, _mm512_and_si512(pro, rolv_avx512(gen, rot2)));
+  pro = _mm512_and_si512(pro, rolv_avx512(pro, rot2));
+  return _mm512_or_si512(gen, _mm512_and_si512(pro, rolv_avx512(gen, rot4)));
+}
+
+// Same steps as fill_legal_moves, all eight directions in one register.
+__attribute__((target("avx512f,avx2,bmi,bmi2")))
+static bits_t
+legal_moves_avx512(bits_t mine, bits_t theirs)
+{
+  const __m512i rot1 = _mm512_load_si512(AVX512_ROTATES);
+  const __m512i mask = _mm512_load_si512(AVX512_MASKS);
+  const __m512i t = _mm512_set1_epi64(theirs);
+
+  const __m512i gen = fill_avx512(_mm512_set1_epi64(mine), _mm512_and_si512(t, mask));
+  const __m512i valid = _mm512_and_si512(mask,
+      rolv_avx512(_mm512_and_si512(gen, t), rot1));
+  return reduce_or_avx512(valid) & ~(mine | theirs);
+}
+
+// Same steps as fill_flipped, all eight directions in one register.
+__attribute__((target("avx512f,avx2,bmi,bmi2")))
+static bits_t
+flipped_avx512(bits_t mine, bits_t theirs, bits_t pos)
+{
+  const __m512i rot1 = _mm512_load_si512(AVX512_ROTATES);
+  const __m512i mask = _mm512_load_si512(AVX512_MASKS);
+  const __m512i m = _mm512_set1_epi64(mine);
+  const __m512i t = _mm512_set1_epi64(theirs);
+
+  const __m512i gen = fill_avx512(_mm512_set1_epi64(pos), _mm512_and_si512(t, mask));
+  const __m512i out = _mm512_and_si512(_mm512_and_si512(m, mask),
+                                       rolv_avx512(gen, rot1));
+  const __m512i flip = _mm512_maskz_and_epi64(_mm512_test_epi64_mask(out, out), gen, t);
+  return reduce_or_avx512(flip);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Batched kernels, vectorized for AVX2 (4 boards per register) and AVX-512 (8)
+__attribute__((target("avx2")))
+static void
+legal_moves_batch_avx2(const bits_t* mine, const bits_t* theirs, bits_t* moves, size_t n)
+{
+  legal_moves_loop(mine, theirs, moves, n);
+}
+
+__attribute__((target("avx2")))
+static void
+effect_move_batch_avx2(bits_t* mine, bits_t* theirs, const bits_t* pos, size_t n)
+{
+  effect_move_loop(mine, theirs, pos, n);
+}
+
+__attribute__((target("avx512f,avx512vl,prefer-vector-width=512")))
+static void
+legal_moves_batch_avx512(const bits_t* mine, const bits_t* theirs, bits_t* moves, size_t n)
+{
+  legal_moves_loop(mine, theirs, moves, n);
+}
+
+__attribute__((target("avx512f,avx512vl,prefer-vector-width=512")))
+static void
+effect_move_batch_avx512(bits_t* mine, bits_t* theirs, const bits_t* pos, size_t n)
+{
+  effect_move_loop(mine, theirs, pos, n);
+}
+
+// The playouts at BMI2 and up pick moves with pdep, one lane at a time, which
+// is faster than the vectorized nth_set_bit:
+__attribute__((target("bmi,bmi2,popcnt")))
+static void
+playout_ply_bmi2(PlayoutLanes& lanes)
+{
+  playout_ply_loop<select_pdep>(lanes);
+}
+
+__attribute__((target("avx2,bmi,bmi2,popcnt")))
+static void
+playout_ply_avx2(PlayoutLanes& lanes)
+{
+  playout_ply_loop<select_pdep>(lanes);
+}
+
+// Zen and Zen 2 have slow pdep (see AVX2_SLOW_PEXT below):
+__attribute__((target("avx2")))
+static void
+playout_ply_avx2_nopdep(PlayoutLanes& lanes)
+{
+  playout_ply_loop<random_set_bit>(lanes);
+}
+
+__attribute__((target("avx512f,avx512vl,bmi,bmi2,popcnt,prefer-vector-width=512")))
+static void
+playout_ply_avx512(PlayoutLanes& lanes)
+{
+  playout_ply_loop<select_pdep>(lanes);
+}
+#endif // X86_KERNELS
+
+////////////////////////////////////////////////////////////////////////////////
+// Kernel table, indexed by Isa:
+#ifdef KOGGE_STONE
+#  define SCALAR_LEGAL_MOVES all_legal_moves_fill
+#  define SCALAR_FLIPPED all_flipped_fill
+#else
+#  define SCALAR_LEGAL_MOVES all_legal_moves_fsm
+#  define SCALAR_FLIPPED all_flipped_scan
+#endif
+
+static const Kernels KERNELS[] = {
+  { Isa::SCALAR, "scalar", SCALAR_LEGAL_MOVES, SCALAR_FLIPPED, select_move_uniform,
+    legal_moves_batch, effect_move_batch, playout_ply },
+#ifdef X86_KERNELS
+  { Isa::BMI2,   "bmi2",   SCALAR_LEGAL_MOVES, flipped_pext,   select_move_pdep,
+    legal_moves_batch, effect_move_batch, playout_ply_bmi2 },
+  { Isa::AVX2,   "avx2",   legal_moves_avx2,   flipped_pext,   select_move_pdep,
+    legal_moves_batch_avx2, effect_move_batch_avx2, playout_ply_avx2 },
+  { Isa::AVX512, "avx512", legal_moves_avx512, flipped_avx512, select_move_pdep,
+    legal_moves_batch_avx512, effect_move_batch_avx512, playout_ply_avx512 },
+#endif
+};
+
+#ifdef X86_KERNELS
+// AMD's Zen and Zen 2 implement pext/pdep in microcode, much slower than the
+// vectorized fill, so AVX2 flips on those go through the vector registers,
+// and move selection avoids pdep too:
+static const Kernels AVX2_SLOW_PEXT =
+  { Isa::AVX2,   "avx2-nopext", legal_moves_avx2, flipped_avx2, select_move_uniform,
+    legal_moves_batch_avx2, effect_move_batch_avx2, playout_ply_avx2_nopdep };
+
+static bool
+slow_pext()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_is("znver1") || __builtin_cpu_is("znver2");
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// The BMI2 level also covers BMI1, and every vector level requires BMI2 too,
+// because the vector kernels share the pdep selection kernel. The AVX-512
+// level also requires AVX-512VL, which the batched and playout kernels use.
+Isa
+best_isa()
+{
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("bmi") || !__builtin_cpu_supports("bmi2")) {
+    return Isa::SCALAR;
+  }
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {
+    return Isa::AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return Isa::AVX2;
+  }
+  return Isa::BMI2;
+#else
+  return Isa::SCALAR;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const Kernels&
+kernels_for(Isa isa)
+{
+  assert(isa <= best_isa() && "Can't use kernels the CPU doesn't support");
+#ifdef X86_KERNELS
+  if (isa == Isa::AVX2 && slow_pext()) {
+    return AVX2_SLOW_PEXT;
+  }
+#endif
+  return KERNELS[int(isa)];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+std::vector<const Kernels*>
+supported_kernels()
+{
+  std::vector<const Kernels*> ret;
+  for (const auto& k : KERNELS) {
+    if (k.isa_ <= best_isa()) {
+      ret.push_back(&k);
+    }
+  }
+#ifdef X86_KERNELS
+  if (best_isa() >= Isa::AVX2) {
+    ret.push_back(&AVX2_SLOW_PEXT);
+  }
+#endif
+  return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reads an optional cap on the level from the environment variable KERNEL_ISA.
+const Kernels&
+active_kernels()
+{
+  static const Kernels& active = [](){
+    auto isa = best_isa();
+    if (auto isa_str = getenv("KERNEL_ISA")) {
+      for (const auto& k : KERNELS) {
+        if (!strcmp(isa_str, k.name_)) {
+          isa = std::min(isa, k.isa_);
+        }
+      }
+    }
+    return kernels_for(isa);
+  }();
+
+  return active;
+}
+
+} // namespace
@@ -0,0 +1,67 @@
+/*
+ * Run-time selection of the innermost bitboard routines ("kernels").
+ * Each kernel has a portable scalar implementation and possibly faster ones
+ * that require specific x86 instruction-set extensions (BMI2, AVX2, AVX-512).
+ * The best set of kernels that the running CPU supports is picked once, on
+ * first use, so a single portable binary still runs the fast paths wherever
+ * they're available.
+ *
+ * The environment variable KERNEL_ISA (one of scalar, bmi2, avx2, avx512) can
+ * cap the selected level, e.g., for testing or benchmarking.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "bits.hh"
+
+namespace Othello {
+
+struct PlayoutLanes;  // See playouts.hh
+
+// Instruction-set levels, in increasing order of capability. Every level
+// implies all the ones before it.
+enum class Isa { SCALAR = 0, BMI2 = 1, AVX2 = 2, AVX512 = 3 };
+
+// One complete set of kernels, all targeting the same instruction-set level:
+struct Kernels {
+  Isa isa_;
+  const char* name_;
+
+  // Bitmap of all the legal moves for `mine' against `theirs':
+  bits_t (*legal_moves_)(bits_t mine, bits_t theirs);
+
+  // Bitmap of all the positions flipped by a (legal) move at `pos':
+  bits_t (*flipped_)(bits_t mine, bits_t theirs, bits_t pos);
+
+  // Pick a single move out of a nonempty bitmap of moves, given a random word:
+  bits_t (*select_move_)(bits_t moves, uint64_t rnd);
+
+  // Batched legal_moves_ over n boards, given as separate arrays:
+  void (*legal_moves_batch_)(const bits_t* mine, const bits_t* theirs,
+                             bits_t* moves, size_t n);
+
+  // Effect pos[i] (or pass, if zero) on n boards, in place:
+  void (*effect_move_batch_)(bits_t* mine, bits_t* theirs,
+                             const bits_t* pos, size_t n);
+
+  // Advance every lane of a playout engine by one random move (or pass):
+  void (*playout_ply_)(PlayoutLanes& lanes);
+};
+
+// Highest level supported by the running CPU (ignoring KERNEL_ISA):
+Isa best_isa();
+
+// The kernels for a given level, which must not exceed best_isa():
+const Kernels& kernels_for(Isa isa);
+
+// The kernels picked for this process (best_isa(), capped by KERNEL_ISA):
+const Kernels& active_kernels();
+
+// Every set of kernels this CPU can run, including alternatives that aren't
+// the default for their level (for testing and benchmarking):
+std::vector<const Kernels*> supported_kernels();
+
+} // namespace
@@ -4,13 +4,18 @@
 
 #include "mcts_node.hh"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <memory>
 
 namespace Othello {
 
 ////////////////////////////////////////////////////////////////////////////////
 void
-MCTSNode::mark_win(Color whom)
+MCTSStats::mark_win(Color whom)
 {
   if (whom == Color::DARK) {
     count_wins(1, 0);
@@ -20,36 +25,704 @@ MCTSNode::mark_win(Color whom)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// Each playout has at most one winner, so skip the other counter's update:
 void
-MCTSNode::count_wins(uint32_t d_wins, uint32_t l_wins)
+MCTSStats::count_wins(uint32_t d_wins, uint32_t l_wins)
 {
-  d_wins_ += d_wins;
-  l_wins_ += l_wins;
-
-  if (parent_) {
-    parent_->count_wins(d_wins, l_wins);
+  if (d_wins) {
+    shared(d_wins_).fetch_add(d_wins, std::memory_order_relaxed);
+  }
+  if (l_wins) {
+    shared(l_wins_).fetch_add(l_wins, std::memory_order_relaxed);
   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 double
-MCTSNode::win_odds(Color whom) const
+MCTSStats::win_odds(Color whom) const
 {
-  const double wins = (whom == Color::DARK)? d_wins_ : l_wins_;
-  const double losses = (whom == Color::DARK)? l_wins_ : d_wins_;
+  const double wins = shared((whom == Color::DARK)? d_wins_ : l_wins_).load(std::memory_order_relaxed);
+  const double losses = shared((whom == Color::DARK)? l_wins_ : d_wins_).load(std::memory_order_relaxed);
   return wins / (losses + 1);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Draws and playouts still in progress count as losses.
+double
+MCTSStats::win_rate(Color whom) const
+{
+  const double visits = std::max(1u, this->visits());
+  return shared((whom == Color::DARK)? d_wins_ : l_wins_).load(std::memory_order_relaxed) / visits;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+double
+MCTSStats::ucb1(Color whom, double log_parent_visits, double exploration) const
+{
+  const double visits = std::max(1u, this->visits());
+  return win_rate(whom) + exploration * std::sqrt(log_parent_visits / visits);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The margin maps tile differences from -N2 to N2 onto [0, 1].
+uint32_t
+MCTSScore::dark_score(int tile_diff, double margin)
+{
+  const double outcome = (tile_diff > 0)? 1 : (tile_diff < 0)? 0 : 0.5;
+  const double tiles = double(tile_diff + int(N2)) / (2 * N2);
+  return std::lround(((1 - margin) * outcome + margin * tiles) * SCORE_UNIT);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t
+MCTSScore::dark_score(Proof proof)
+{
+  switch (proof) {
+    case Proof::DARK_WINS:  return SCORE_UNIT;
+    case Proof::LIGHT_WINS: return 0;
+    default:                return SCORE_UNIT / 2;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Light's sum is kept too, so that the finished playouts can be counted
+// (their scores always add up to one), even while others are in progress.
+void
+MCTSScore::add(uint32_t dark)
+{
+  shared(dark_).fetch_add(dark, std::memory_order_relaxed);
+  shared(light_).fetch_add(SCORE_UNIT - dark, std::memory_order_relaxed);
+  shared(squares_).fetch_add(uint64_t(dark) * dark, std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+double
+MCTSScore::mean(Color whom, uint32_t visits) const
+{
+  const double sum = shared((whom == Color::DARK)? dark_ : light_).load(std::memory_order_relaxed);
+  return sum / SCORE_UNIT / std::max(1u, visits);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The three sums are read one at a time, while other threads may add to them,
+// so the result is clamped to the possible range of a variance in [0, 1].
+double
+MCTSScore::variance() const
+{
+  const double dark = shared(dark_).load(std::memory_order_relaxed);
+  const double games = (dark + shared(light_).load(std::memory_order_relaxed)) / SCORE_UNIT;
+  if (games < 1) {
+    return 0.25;
+  }
+  const double mean = dark / SCORE_UNIT / games;
+  const double squares = shared(squares_).load(std::memory_order_relaxed) /
+                         double(SCORE_UNIT * SCORE_UNIT) / games;
+  return std::clamp(squares - mean * mean, 0., 0.25);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 std::ostream&
 MCTSNode::operator<<(std::ostream& os)
 {
-  os << "Node has board: " << board_ << "\n";
-  os << "turn: " << ((turn() == Color::LIGHT)? "light" : "dark") << "\t";
+  os << "Node has move: " << int(square_) << "\t";
   os << "dark wins: " << d_wins_ << "\t";
-  os << "light wins: " << l_wins_ << "\n";
+  os << "light wins: " << l_wins_ << "\t";
+  os << "visits: " << visits() << "\n";
   return os;
 }
 
-} // namespace
+////////////////////////////////////////////////////////////////////////////////
+// The table starts out all zeros (i.e., unused), which calloc provides without
+// touching its pages.
+MCTSTree::MCTSTree(size_t capacity, size_t positions, bool scores, bool amaf)
+: nodes_(std::allocator<MCTSNode>().allocate(capacity)),
+  capacity_(capacity),
+  size_(0),
+  root_(NO_NODE),
+  board_(),
+  turn_(Color::DARK),
+  forward_(),
+  positions_(positions? static_cast<Position*>(std::calloc(positions, sizeof(Position))) : nullptr),
+  npositions_(positions_? positions : 0),
+  nslots_(0),
+  hashes_(positions_? std::allocator<uint64_t>().allocate(capacity) : nullptr),
+  entries_(positions_? std::allocator<node_idx_t>().allocate(capacity) : nullptr),
+  scores_(scores? std::allocator<MCTSScore>().allocate(capacity) : nullptr),
+  amaf_(amaf? std::allocator<uint64_t>().allocate(capacity) : nullptr)
+{
+  size_table(0);
+  assert(capacity < NO_NODE);
+  assert(positions < NO_NODE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+MCTSTree::~MCTSTree()
+{
+  std::allocator<MCTSNode>().deallocate(nodes_, capacity_);
+  std::free(positions_);
+  if (hashes_) {
+    std::allocator<uint64_t>().deallocate(hashes_, capacity_);
+    std::allocator<node_idx_t>().deallocate(entries_, capacity_);
+  }
+  if (scores_) {
+    std::allocator<MCTSScore>().deallocate(scores_, capacity_);
+  }
+  if (amaf_) {
+    std::allocator<uint64_t>().deallocate(amaf_, capacity_);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSTree::reset(Board board, Color turn)
+{
+  clear();
+  board_ = board;
+  turn_ = turn;
+  root_ = allocate(1);
+  assert(root_ != NO_NODE);
+  make_node(root_, NO_NODE, PASS, hashes_? zobrist_hash(board, turn) : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Every position in the table has at least one node, so clearing the entries
+// of all the nodes clears the whole table.
+void
+MCTSTree::clear()
+{
+  for (size_t i = 0; npositions_ && i < size(); ++i) {
+    if (entries_[i] != NO_NODE) {
+      positions_[entries_[i]] = Position();
+    }
+  }
+  size_table(size());
+  size_ = 0;
+  root_ = NO_NODE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+double
+MCTSTree::amaf_rate(node_idx_t idx) const
+{
+  assert(amaf_);
+  const auto amaf = shared(amaf_[idx]).load(std::memory_order_relaxed);
+  return double(amaf >> 32) / std::max(uint32_t(amaf), 1u);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+const MCTSStats&
+MCTSTree::stats(node_idx_t idx) const
+{
+  const auto& node = nodes_[idx];
+  return node.transposed()? static_cast<const MCTSStats&>(positions_[entries_[idx]]) : node;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSTree::add_visit(node_idx_t idx)
+{
+  nodes_[idx].add_visit();
+  if (nodes_[idx].transposed()) {
+    positions_[entries_[idx]].add_visit();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSTree::make_node(node_idx_t idx, node_idx_t parent, uint8_t square, uint64_t hash)
+{
+  new (&nodes_[idx]) MCTSNode(parent, square);
+  if (scores_) {
+    new (&scores_[idx]) MCTSScore();
+  }
+  if (amaf_) {
+    amaf_[idx] = 0;
+  }
+  if (hashes_) {
+    hashes_[idx] = hash;
+    if ((entries_[idx] = find_position(hash)) != NO_NODE) {
+      add_position(idx);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A slot is claimed for a position by setting its key, with a CAS so that
+// two threads adding the same position (or two that collide) agree on it.
+// Its counters are zero until then, so the claiming thread has nothing else
+// to publish. A zero hash is stored as 1, since zero marks unused slots.
+node_idx_t
+MCTSTree::find_position(uint64_t hash)
+{
+  constexpr unsigned MAX_PROBES = 8;
+  if (!nslots_) {
+    return NO_NODE;
+  }
+
+  const uint64_t key = hash? hash : 1;
+  size_t slot = key % nslots_;
+  for (unsigned probe = 0; probe < MAX_PROBES; ++probe) {
+    uint64_t found = shared(positions_[slot].key_).load(std::memory_order_relaxed);
+    if (!found && shared(positions_[slot].key_).compare_exchange_strong(found, key,
+                                                                        std::memory_order_relaxed)) {
+      return slot;
+    }
+    if (found == key) {
+      return slot;
+    }
+    slot = (slot + 1 == nslots_)? 0 : slot + 1;
+  }
+  return NO_NODE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The first node to register with a position is its only node. Any later one
+// marks the position as shared, and whichever node was the only one until then
+// joins it in sharing. This holds whatever order concurrent threads get here in.
+// A node is registered with release semantics, so that the thread sharing it
+// sees it fully built.
+void
+MCTSTree::add_position(node_idx_t idx)
+{
+  auto& position = positions_[entries_[idx]];
+  node_idx_t none = 0;
+  if (shared(position.node_).compare_exchange_strong(none, idx + 1, std::memory_order_release,
+                                                     std::memory_order_relaxed)) {
+    return;
+  }
+  const auto only = shared(position.node_).exchange(SHARED, std::memory_order_acquire);
+  if (only != SHARED) {
+    share_position(only - 1);
+  }
+  share_position(idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The node is marked first, and its counters copied after: playouts that
+// update it in between are counted twice in the position, rather than not at
+// all, so that taking back their visits can't underflow the position's. The
+// next compaction makes the counts exact again.
+void
+MCTSTree::share_position(node_idx_t idx)
+{
+  auto& node = nodes_[idx];
+  auto& position = positions_[entries_[idx]];
+  shared(node.transposed_).store(true);
+  if (const auto visits = node.visits()) {
+    shared(position.visits_).fetch_add(visits, std::memory_order_relaxed);
+  }
+  position.count_wins(shared(node.d_wins_).load(std::memory_order_relaxed),
+                      shared(node.l_wins_).load(std::memory_order_relaxed));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The table could have a slot for every node of a full arena, but a search
+// rarely fills it, and scattering a small tree's positions over a large table
+// costs a cache miss (and often a TLB miss) per access. The next tree is
+// likely to be about as big as the last one, so a few times its size leaves
+// plenty of free slots, and a tree that outgrows them only loses some sharing.
+void
+MCTSTree::size_table(size_t nodes)
+{
+  constexpr size_t MIN_SLOTS = 1 << 16;
+  nslots_ = std::min(npositions_, std::max(MIN_SLOTS, 4 * nodes));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+node_idx_t
+MCTSTree::allocate(unsigned n)
+{
+  auto size = shared(size_).load(std::memory_order_relaxed);
+  do {
+    if (size + n > capacity_) {
+      return NO_NODE;
+    }
+  } while (!shared(size_).compare_exchange_weak(size, size + n, std::memory_order_relaxed));
+  return size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The untried moves (or pass child) are set before the node is published as
+// expanded (with release semantics), so a thread that sees expanded() also
+// sees them.
+bool
+MCTSTree::expand(node_idx_t idx, Board board, Color turn)
+{
+  auto& node = nodes_[idx];
+  uint8_t leaf = MCTSNode::LEAF;
+  if (!shared(node.state_).compare_exchange_strong(leaf, MCTSNode::EXPANDING,
+                                                   std::memory_order_relaxed)) {
+    return false;
+  }
+
+  const auto moves = all_legal_moves(board, turn);
+  if (!moves && all_legal_moves(board, opponent_of(turn))) {
+    const auto pass = allocate(1);
+    if (pass == NO_NODE) {  // Out of memory, try again later
+      shared(node.state_).store(MCTSNode::LEAF, std::memory_order_relaxed);
+      return false;
+    }
+    make_node(pass, idx, PASS, hashes_? zobrist_pass(hashes_[idx]) : 0);
+    node.first_child_ = pass;
+  }
+
+  auto proof = Proof::UNKNOWN;
+  if (!moves && node.first_child_ == NO_NODE) {  // Game over
+    const int diff = int(bits_set(board.dark())) - int(bits_set(board.light()));
+    proof = (diff > 0)? Proof::DARK_WINS : (diff < 0)? Proof::LIGHT_WINS : Proof::DRAW;
+  }
+  node.untried_ = moves;
+  node.moves_ = moves? bits_set(moves) : (node.first_child_ != NO_NODE);
+  shared(node.state_).store(MCTSNode::EXPANDED | (uint8_t(proof) << MCTSNode::PROOF_SHIFT),
+                            std::memory_order_release);
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A thread first claims its move by clearing it from the untried moves, then
+// builds the child, and only then links it at the head of the children list
+// (with release semantics), so other threads never see a partial child.
+node_idx_t
+MCTSTree::add_child(node_idx_t idx, Board& board, Color turn)
+{
+  auto& node = nodes_[idx];
+  assert(node.expanded());
+  auto untried = node.untried();
+  do {
+    if (!untried) {
+      return NO_NODE;
+    }
+  } while (!shared(node.untried_).compare_exchange_weak(untried, untried & (untried - 1),
+                                                        std::memory_order_relaxed));
+
+  const bits_t move = untried & -untried;
+  const auto child = allocate(1);
+  if (child == NO_NODE) {  // Out of memory: put the move back
+    shared(node.untried_).fetch_or(move, std::memory_order_relaxed);
+    return NO_NODE;
+  }
+
+  // The hash is only needed with a table:
+  uint64_t hash = 0;
+  if (hashes_) {
+    hash = hashes_[idx];
+    board = effect_move(board, turn, move, hash);
+  } else {
+    board = effect_move(board, turn, move);
+  }
+  make_node(child, idx, __builtin_ctzll(move), hash);
+  auto head = shared(node.first_child_).load(std::memory_order_relaxed);
+  do {
+    nodes_[child].next_sibling_ = head;
+  } while (!shared(node.first_child_).compare_exchange_weak(head, child,
+                                                            std::memory_order_release,
+                                                            std::memory_order_relaxed));
+  return child;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+node_idx_t
+MCTSTree::select_child(node_idx_t idx, Color turn, double exploration, double rave) const
+{
+  const auto& node = nodes_[idx];
+  assert(node.first_child() != NO_NODE);
+  const auto parent_visits = scores_? node.visits() : stats(idx).visits();
+  const double log_visits = std::log(double(std::max(1u, parent_visits)));
+  const auto lost = win_for(opponent_of(turn));
+  node_idx_t best = NO_NODE;
+  double best_ucb = -2;
+
+  for (auto child = node.first_child(); child != NO_NODE; child = nodes_[child].next_sibling_) {
+    const auto& child_stats = scores_? static_cast<const MCTSStats&>(nodes_[child]) : stats(child);
+    if (nodes_[child].proof() == lost) {  // Only if there's nothing else
+      if (best == NO_NODE) {
+        best_ucb = -1;
+        best = child;
+      }
+      continue;
+    }
+    if (!child_stats.visits()) {
+      return child;
+    }
+    double rate, ucb;
+    if (scores_) {
+      const double visits = std::max(1u, child_stats.visits());
+      rate = scores_[child].mean(turn, visits);
+      const double spread = std::min(1., 4 * (scores_[child].variance() +
+                                              std::sqrt(2 * log_visits / visits)));
+      ucb = rate + exploration * std::sqrt(log_visits / visits * spread);
+    } else {
+      rate = child_stats.win_rate(turn);
+      ucb = child_stats.ucb1(turn, log_visits, exploration);
+    }
+    if (rave > 0 && amaf_ && amaf_visits(child)) {
+      const double beta = std::sqrt(rave / (3. * child_stats.visits() + rave));
+      ucb += beta * (amaf_rate(child) - rate);
+    }
+    if (ucb > best_ucb) {
+      best_ucb = ucb;
+      best = child;
+    }
+  }
+  return best;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+node_idx_t
+MCTSTree::most_visited_child(node_idx_t idx) const
+{
+  node_idx_t best = NO_NODE;
+  for (auto child = nodes_[idx].first_child(); child != NO_NODE; child = nodes_[child].next_sibling_) {
+    if (best == NO_NODE || nodes_[child].visits() > nodes_[best].visits()) {
+      best = child;
+    }
+  }
+  return best;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+node_idx_t
+MCTSTree::find_child(node_idx_t idx, bits_t pos) const
+{
+  const uint8_t square = pos? pos2bit(pos) : PASS;
+  for (auto child = nodes_[idx].first_child(); child != NO_NODE; child = nodes_[child].next_sibling_) {
+    if (nodes_[child].square_ == square) {
+      return child;
+    }
+  }
+  return NO_NODE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSTree::count_wins(node_idx_t idx, uint32_t d_wins, uint32_t l_wins)
+{
+  for (; idx != NO_NODE; idx = nodes_[idx].parent_) {
+    nodes_[idx].count_wins(d_wins, l_wins);
+    if (nodes_[idx].transposed()) {
+      positions_[entries_[idx]].count_wins(d_wins, l_wins);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSTree::count_score(node_idx_t idx, uint32_t dark)
+{
+  assert(scores_);
+  for (; idx != NO_NODE; idx = nodes_[idx].parent_) {
+    scores_[idx].add(dark);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Walking up from the leaf, each node's move joins the moves of the player who
+// made it, before its parent's children are counted, so that a node on the
+// path counts its own move too. A child's AMAF visits and wins are counted
+// with a single atomic add.
+void
+MCTSTree::count_amaf(node_idx_t idx, Color turn, bits_t dark_moves, bits_t light_moves,
+                     bool d_won, bool l_won)
+{
+  assert(amaf_);
+  for (; idx != NO_NODE; idx = nodes_[idx].parent_) {
+    const bits_t played = (turn == Color::DARK)? dark_moves : light_moves;
+    const uint64_t count = 1 + (uint64_t((turn == Color::DARK)? d_won : l_won) << 32);
+    for (auto child = nodes_[idx].first_child(); played && child != NO_NODE;
+         child = nodes_[child].next_sibling_) {
+      const auto square = nodes_[child].square_;
+      if (square != PASS && (played & (ONE << square))) {
+        shared(amaf_[child]).fetch_add(count, std::memory_order_relaxed);
+      }
+    }
+
+    turn = opponent_of(turn);
+    if (nodes_[idx].square_ != PASS) {
+      ((turn == Color::DARK)? dark_moves : light_moves) |= ONE << nodes_[idx].square_;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The minimax rule of MCTS-Solver, one level at a time: a parent is settled
+// either by a single child that's a win for its mover, or by all its moves
+// together. The latter needs a proven child for every legal move: one that's
+// still untried, or pruned back to untried, or claimed by a thread that
+// hasn't linked it yet, leaves the parent to a later visit.
+void
+MCTSTree::propagate_proof(node_idx_t idx, Color turn)
+{
+  for (auto proof = nodes_[idx].proof(); proof != Proof::UNKNOWN; ) {
+    idx = nodes_[idx].parent_;
+    if (idx == NO_NODE || nodes_[idx].proven()) {
+      return;
+    }
+    turn = opponent_of(turn);  // Now the player to move at idx
+    const auto& node = nodes_[idx];
+    if (proof != win_for(turn)) {
+      proof = win_for(opponent_of(turn));
+      unsigned proven = 0;
+      for (auto child = node.first_child(); child != NO_NODE; child = nodes_[child].next_sibling_) {
+        const auto child_proof = nodes_[child].proof();
+        if (child_proof == Proof::UNKNOWN) {
+          return;
+        } else if (child_proof == win_for(turn)) {  // Proven by another thread meanwhile
+          proof = child_proof;
+          proven = node.moves_;
+          break;
+        } else if (child_proof == Proof::DRAW) {
+          proof = Proof::DRAW;
+        }
+        ++proven;
+      }
+      if (proven < node.moves_) {
+        return;
+      }
+    }
+    shared(node.state_).fetch_or(uint8_t(proof) << MCTSNode::PROOF_SHIFT, std::memory_order_relaxed);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSTree::cancel_visit(node_idx_t idx)
+{
+  for (; idx != NO_NODE; idx = nodes_[idx].parent_) {
+    [[maybe_unused]] const auto visits =
+      shared(nodes_[idx].visits_).fetch_sub(1, std::memory_order_relaxed);
+    assert(visits > 0);
+    if (nodes_[idx].transposed()) {
+      shared(positions_[entries_[idx]].visits_).fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSTree::advance_root(node_idx_t idx)
+{
+  assert(idx < size());
+
+  // Replay the moves from the old root to find the new root's board:
+  uint8_t path[2 * N2];
+  unsigned depth = 0;
+  for (auto node = idx; node != root_; node = nodes_[node].parent_) {
+    assert(depth < 2 * N2);
+    path[depth++] = nodes_[node].square_;
+  }
+  while (depth--) {
+    if (path[depth] != PASS) {
+      board_ = effect_move(board_, turn_, ONE << path[depth]);
+    }
+    turn_ = opponent_of(turn_);
+  }
+
+  compact(idx, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A node never has more visits than its parent, so keeping the nodes with the
+// most visits also keeps all of their ancestors. The root is always kept.
+size_t
+MCTSTree::prune(size_t max_nodes)
+{
+  const auto old_size = size();
+  if (old_size <= max_nodes || !max_nodes) {
+    return 0;
+  }
+
+  // Find the visits of the max_nodes-th most visited node, and keep only
+  // the nodes with more visits than that:
+  forward_.resize(old_size);
+  for (size_t i = 0; i < old_size; ++i) {
+    forward_[i] = nodes_[i].visits();
+  }
+  const auto nth = forward_.begin() + (max_nodes - 1);
+  std::nth_element(forward_.begin(), nth, forward_.end(), std::greater<node_idx_t>());
+
+  compact(root_, *nth + 1);
+  return old_size - size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A child is always allocated after its parent, so a single pass in index
+// order, starting at the new root, finds the whole subtree (and gives each
+// node its new index). A second pass then moves every node to its new index,
+// which is never higher than its old one, after the node's children (which
+// haven't moved yet) are relinked to skip the discarded ones. A pass child
+// is always kept, since its parent can't grow it back. The positions table is
+// then rebuilt from the counters of the remaining nodes.
+void
+MCTSTree::compact(node_idx_t idx, uint32_t min_visits)
+{
+  const auto old_size = size();
+  forward_.assign(old_size, NO_NODE);
+  forward_[idx] = 0;
+  node_idx_t live = 0;
+  for (auto i = idx; i < old_size; ++i) {
+    if (forward_[i] != NO_NODE) {
+      forward_[i] = live++;
+      for (auto child = nodes_[i].first_child_; child != NO_NODE; child = nodes_[child].next_sibling_) {
+        if (nodes_[child].visits() >= min_visits || nodes_[child].square_ == PASS) {
+          forward_[child] = 0;
+        }
+      }
+    }
+  }
 
+  if (npositions_) {  // Before the nodes move over each other
+    for (size_t i = 0; i < old_size; ++i) {
+      if (entries_[i] != NO_NODE) {
+        positions_[entries_[i]] = Position();
+      }
+    }
+    size_table(old_size);
+  }
+
+  for (auto i = idx; i < old_size; ++i) {
+    if (forward_[i] == NO_NODE) {
+      continue;
+    }
+    auto node = nodes_[i];
+    if (i == idx) {
+      node.parent_ = node.next_sibling_ = NO_NODE;
+    } else {
+      node.parent_ = forward_[node.parent_];  // next_sibling_ was set by the parent
+    }
+
+    auto* link = &node.first_child_;
+    for (auto child = node.first_child_; child != NO_NODE; ) {
+      const auto next = nodes_[child].next_sibling_;
+      if (forward_[child] != NO_NODE) {
+        *link = forward_[child];
+        link = &nodes_[child].next_sibling_;
+      } else {
+        node.untried_ |= ONE << nodes_[child].square_;
+      }
+      child = next;
+    }
+    *link = NO_NODE;
+    nodes_[forward_[i]] = node;
+    if (hashes_) {
+      hashes_[forward_[i]] = hashes_[i];
+    }
+    if (scores_) {
+      scores_[forward_[i]] = scores_[i];
+    }
+    if (amaf_) {
+      amaf_[forward_[i]] = amaf_[i];
+    }
+  }
+
+  size_ = live;
+  root_ = 0;
+
+  for (node_idx_t i = 0; npositions_ && i < live; ++i) {
+    nodes_[i].transposed_ = false;
+    if ((entries_[i] = find_position(hashes_[i])) != NO_NODE) {
+      add_position(i);
+    }
+  }
+}
+
+} // namespace
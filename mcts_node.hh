@@ -1,73 +1,415 @@
 /*
  * Class definitions for a node and a tree of nodes for Monte-Carlo Tree Search.
- * An MCTS starts from a vector of current available moves, for a given player.
- * One of these moves is picked at random, and a game is simulated to completion
- * from this node (move), eventually incrementing a counter for the winner,
- * two counters per node (one for each player). When the search is over, using
- * any desired termination criterion, the node (move) with the best winning
- * odds for the current player is picked.
+ * Each node represents a board state and the player to move in it. The search
+ * grows a game tree from the current board, one playout at a time:
  *
- * Nodes can be organized into layers (levels of the tree), starting from the
- * current possible move, and possibly elaborating a full game tree for a few
- * moves (levels). The tree search can then start from the nodes at the lowest
- * computed level instead of the top (current) level, to memoize the first few
- * moves.
+ *  - Selection: starting at the root, repeatedly descend to the child with the
+ *    highest UCB1 value (see select_child), until reaching a leaf.
+ *  - Expansion: a leaf that has already been visited before has its legal
+ *    moves computed, and from then on, every visit to the node adds a child
+ *    for one more of its untried moves and descends into it, until all the
+ *    moves have been tried. Only then does selection resume among the
+ *    children by UCB1. So a node visited k times has at most k children,
+ *    instead of its whole fan-out (often 10-15 moves).
+ *  - Simulation: a random game is played to completion from the leaf.
+ *  - Backpropagation: the winner's counter is incremented in the leaf and in
+ *    all of its ancestors, through the parent links.
  *
- * Each node represents a board state, and keeps track of the total wins for
- * dark and light players that have been encountered in the random tree search.
- * Each node also holds a pointer to the parent node, the board from which this
- * move was derived (or nullptr if its the top level of the memoized tree).
+ * When the search is over, using any desired termination criterion, the
+ * root's most visited child is picked as the best move. The subtree under
+ * that child can then be kept as the starting tree of later searches.
+ *
+ * With few playouts, a node's win rate is a noisy estimate. Optionally
+ * (RAVE), selection also uses all-moves-as-first (AMAF) counters: a child
+ * counts every playout through its parent in which its move was played by the
+ * same player, at any later point in the game, not only right away. Those
+ * build up much faster, but are biased, so their weight in the child's value
+ * shrinks as its own visits grow (see select_child). Like the scores below,
+ * the AMAF counters live in an array beside the arena, only when enabled.
+ *
+ * Visits are counted on the way down, before the outcome of a playout is
+ * known, so playouts that are still in flight count as losses for the node
+ * (a "virtual loss"). That steers concurrent playouts apart, instead of
+ * sending them all down the same path.
+ *
+ * Any number of threads can search the same tree at once, without locks: all
+ * the counters are updated atomically, and a node is expanded by the first
+ * thread that claims it (other threads that reach it in the meantime play
+ * out from it as a leaf). Each untried move is claimed by exactly one thread,
+ * which then links the new child into its parent's list of children.
+ *
+ * Nodes live in a preallocated arena (MCTSTree), and refer to each other by
+ * 32-bit indices into it. The children of a node form a singly linked list,
+ * newest first. Nodes don't store their boards: the search recomputes them
+ * from the root's board on the way down, from the square of each move. That
+ * makes a node 40 bytes, so millions of them fit in a few tens of MB, and a
+ * search makes no memory allocations at all.
+ *
+ * Different paths through the tree often lead to the same position (a
+ * transposition), which then has several nodes. Every position is listed in a
+ * hash table keyed by its Zobrist hash, and once it has a second node, its
+ * nodes share a set of counters there, which selection reads instead of their
+ * own: a position's statistics are gathered once, whichever path leads to it.
+ * Only about a tenth of the nodes are transpositions, and the others never
+ * touch the table after they're added, which keeps selection cache-friendly.
+ * Each node keeps its own counters too, so that the table can be rebuilt
+ * when nodes are discarded. The hash of each node, and its entry in the
+ * table, are kept in arrays beside the arena, which only exist with a table.
+ *
+ * Counting wins throws away most of what a playout tells: a draw, or a game
+ * won by two tiles, counts the same as a loss, or a rout. Optionally, each
+ * playout can instead back up a score in [0, 1] (see MCTSScore), its outcome
+ * blended with its tile margin, and nodes keep the mean and the variance of
+ * their scores, so selection can explore less among moves whose scores vary
+ * little. The scores live in an array of their own, beside the arena, so
+ * nodes stay just as small when they're off.
+ *
+ * Near the end of the game, the tree can reach terminal positions, whose
+ * outcome is exact (MCTS-Solver). A node whose mover has a move that is a
+ * proven win is a proven win too, and so is a node all of whose moves are
+ * proven losses, for the opponent (see propagate_proof). Selection never
+ * enters a proven loss when there's any other move, and a proven leaf counts
+ * its exact outcome instead of a random game's. Once the root is proven, the
+ * search can stop.
  */
 
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <ostream>
+#include <vector>
 
 #include "bits.hh"
 #include "board.hh"
 #include "moves.hh"
+#include "player.hh"
+#include "zobrist.hh"
 
 namespace Othello {
 
-////////////////////////////////////////////////////////////////////////////////
-// Tree node data
-class MCTSNode {
- public:
-  MCTSNode(Board board, Color turn, bits_t mv = 0, MCTSNode* parent = nullptr)
-  : board_(board), player_(turn), move_(mv),
-    d_wins_(0), l_wins_(0), parent_(parent)
-  {}
+using node_idx_t = uint32_t;  // Index of a node in its tree's arena
+constexpr node_idx_t NO_NODE = ~node_idx_t(0);
 
-  ~MCTSNode() = default;
+constexpr uint8_t PASS = N2;  // Square of a pass "move"
+
+// The exact outcome of a node, once it's known:
+enum class Proof : uint8_t { UNKNOWN, DARK_WINS, LIGHT_WINS, DRAW };
+
+constexpr Proof win_for(Color whom) { return (whom == Color::DARK)? Proof::DARK_WINS : Proof::LIGHT_WINS; }
 
+// Atomic access to a field of a node that other threads may be updating:
+template <typename T>
+std::atomic_ref<T> shared(const T& field) { return std::atomic_ref<T>(const_cast<T&>(field)); }
+
+////////////////////////////////////////////////////////////////////////////////
+// Playout counters, of a node or of a position. They are only updated with
+// relaxed atomics: their values steer the search but don't guard any other
+// data.
+class MCTSStats {
+ public:
   // Signal that a random game that started in this node was won by `who`
-  // This operation needs to be thread-safe.
   void mark_win(Color whom);
 
-  // Add specific win counts for both players:
-  void count_wins(uint32_t b_wins, uint32_t w_wins);
+  // Add specific win counts for both players, to these counters only (see
+  // also MCTSTree::count_wins):
+  void count_wins(uint32_t d_wins, uint32_t l_wins);
+
+  // Count one more playout through this node (see header comment):
+  void add_visit() { shared(visits_).fetch_add(1, std::memory_order_relaxed); }
 
   // Estimate the probabily for player `whom` to win starting from this node
   double win_odds(Color whom) const;
 
-  const Board& board() const { return board_; }
+  // Fraction of the playouts won by player `whom` (in progress ones count as
+  // losses):
+  double win_rate(Color whom) const;
+
+  // Upper confidence bound on the winning rate of player `whom` (who moves
+  // into this node), given the log of the parent's visits:
+  double ucb1(Color whom, double log_parent_visits, double exploration) const;
+
+  uint32_t visits() const { return shared(visits_).load(std::memory_order_relaxed); }
 
-  // Return the color of the current player
-  Color turn() const { return player_; }
+ protected:
+  uint32_t    visits_ = 0;   // How many playouts went through this board
+  uint32_t    d_wins_ = 0;   // How many times dark won from this board
+  uint32_t    l_wins_ = 0;   // How many times light won from this board
+
+  friend class MCTSTree;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Sums of the scores of the playouts through a node (see MCTSTree::count_score).
+// A playout's score for dark is its outcome (1 for a win, 1/2 for a draw, or
+// 0 for a loss), blended with its tile difference, mapped to [0, 1], by a
+// margin weight; light's score is one minus dark's. Scores are fixed-point
+// numbers, in units of 1 / SCORE_UNIT.
+class MCTSScore {
+ public:
+  static constexpr uint64_t SCORE_UNIT = 1 << 16;
+
+  // Dark's score for a playout that ended with tile_diff, or for a proven
+  // outcome (whose margin isn't known, so it only counts as a win or a loss):
+  static uint32_t dark_score(int tile_diff, double margin);
+  static uint32_t dark_score(Proof proof);
+
+  // Add a playout's score for dark:
+  void add(uint32_t dark);
+
+  // Mean score of player `whom` over `visits` playouts through the node (in
+  // progress ones count as zero):
+  double mean(Color whom, uint32_t visits) const;
+
+  // Variance of the scores of the finished playouts (the same for both players):
+  double variance() const;
+
+ private:
+  uint64_t dark_ = 0;     // Sum of dark's scores
+  uint64_t light_ = 0;    // Sum of light's scores
+  uint64_t squares_ = 0;  // Sum of the squares of dark's scores, in units squared
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Tree node data
+class MCTSNode : public MCTSStats {
+ public:
+  MCTSNode(node_idx_t parent = NO_NODE, uint8_t square = PASS)
+  : MCTSStats(), untried_(0), parent_(parent),
+    first_child_(NO_NODE), next_sibling_(NO_NODE), square_(square), state_(LEAF),
+    moves_(0), transposed_(false)
+  {}
+
+  ~MCTSNode() = default;
 
   // Return the move that spawned this board/node
-  bits_t original_move() const { assert(move_); return move_; }
+  bits_t original_move() const { assert(square_ < PASS); return ONE << square_; }
+
+  // Is this the child of a node whose player had to pass?
+  bool is_pass() const { return parent_ != NO_NODE && square_ == PASS; }
+
+  node_idx_t parent() const { return parent_; }
+
+  // Does the node share its position's counters with other nodes?
+  bool transposed() const { return shared(transposed_).load(std::memory_order_relaxed); }
+
+  // The children, newest first (NO_NODE ends the list). A child is fully
+  // built before it's linked, so the list can be walked while it grows.
+  node_idx_t first_child() const { return shared(first_child_).load(std::memory_order_acquire); }
+  node_idx_t next_sibling() const { return next_sibling_; }
+
+  // Legal moves that have no child yet (only known once expanded):
+  bits_t untried() const { return shared(untried_).load(std::memory_order_relaxed); }
+
+  // Has the node's set of moves been computed?
+  bool expanded() const { return (shared(state_).load(std::memory_order_acquire) & STATE) == EXPANDED; }
+  bool terminal() const { return expanded() && !untried() && first_child() == NO_NODE; }
+
+  // The node's exact outcome, with best play from both sides, if proven:
+  Proof proof() const { return Proof(shared(state_).load(std::memory_order_relaxed) >> PROOF_SHIFT); }
+  bool proven() const { return proof() != Proof::UNKNOWN; }
 
   std::ostream& operator<<(std::ostream&);
 
  private:
-  Board      board_;  // The current board
-  Color      player_; // The current player
-  bits_t     move_;   // The (previous) move that led to this board
-  uint32_t   d_wins_; // How many times dark won from this board
-  uint32_t   l_wins_; // How many times light won from this board
-  MCTSNode*  parent_; // Parent node (if any)
+  // The state takes the low bits of state_, and the proof (set once the node
+  // is expanded, and never changed after that) the bits above them:
+  enum State : uint8_t { LEAF, EXPANDING, EXPANDED, STATE = 3 };
+  static constexpr unsigned PROOF_SHIFT = 2;
+
+  bits_t      untried_;       // Legal moves without a child (if expanded)
+  node_idx_t  parent_;        // Index of the parent (if any)
+  node_idx_t  first_child_;   // Index of the newest child (if any)
+  node_idx_t  next_sibling_;  // Index of the parent's previous child (if any)
+  uint8_t     square_;        // The (previous) move that led to this board
+  uint8_t     state_;         // Have the moves been computed? And its proof
+  uint8_t     moves_;         // Number of legal moves, or 1 for a pass (if expanded)
+  bool        transposed_;    // Are the position's counters shared?
+
+  friend class MCTSTree;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// An arena of nodes with a fixed capacity, holding a single tree, and a table
+// of its positions, with room for `positions` of them (none disables
+// sharing). A position that doesn't fit in the table only has the counters of
+// its nodes. With a table, every node also has a hash and a table entry, with
+// `scores`, an MCTSScore, and with `amaf`, AMAF counters, at the same index of
+// arrays beside the arena.
+// The arena, the table and the arrays are allocated once, and their pages are
+// only touched as nodes are used.
+class MCTSTree {
+  // A position, keyed by its hash (zero if unused), and the counters shared
+  // by its nodes, if it has several:
+  struct Position : MCTSStats {
+    node_idx_t node_ = 0;  // Its only node plus one, SHARED for several, or 0 for none yet
+    uint64_t key_ = 0;
+  };
+  static constexpr node_idx_t SHARED = NO_NODE;
+
+ public:
+  explicit MCTSTree(size_t capacity, size_t positions = 0, bool scores = false, bool amaf = false);
+  ~MCTSTree();
+  MCTSTree(const MCTSTree&) = delete;
+  MCTSTree& operator=(const MCTSTree&) = delete;
+
+  // Discard all the nodes, and start a new tree for board with turn to move:
+  void reset(Board board, Color turn);
+
+  // Discard all the nodes, leaving no root:
+  void clear();
+
+  // A tree is empty until it's reset. An empty tree has no root.
+  bool empty() const { return root_ == NO_NODE; }
+  node_idx_t root() const { return root_; }
+  Board root_board() const { return board_; }
+  Color root_turn() const { return turn_; }
+
+  MCTSNode& operator[](node_idx_t idx) { assert(idx < size()); return nodes_[idx]; }
+  const MCTSNode& operator[](node_idx_t idx) const { assert(idx < size()); return nodes_[idx]; }
+
+  // The counters of a node's position, shared with its transpositions (or
+  // the node's own, if its position isn't in the table):
+  const MCTSStats& stats(node_idx_t idx) const;
+
+  // Zobrist hash of a node's position (only with a table, see zobrist.hh):
+  uint64_t hash(node_idx_t idx) const { assert(hashes_); return hashes_[idx]; }
+
+  // The scores of a node's playouts (only with scores). Scores aren't shared
+  // between transpositions:
+  const MCTSScore& score(node_idx_t idx) const { assert(scores_); return scores_[idx]; }
+  bool has_scores() const { return scores_; }
+
+  // AMAF counters of a node (only with amaf): playouts through its parent in
+  // which its move was played by the player who moves into it, and the
+  // fraction of them that player won:
+  uint32_t amaf_visits(node_idx_t idx) const
+  { assert(amaf_); return shared(amaf_[idx]).load(std::memory_order_relaxed); }
+  double amaf_rate(node_idx_t idx) const;
+  bool has_amaf() const { return amaf_; }
+
+  // Count one more playout through a node and its position:
+  void add_visit(node_idx_t idx);
+
+  // Compute the moves of a node, which has board and turn to move: its legal
+  // moves become untried moves, or if only the opponent can move, a single
+  // pass child is added, or else the node is terminal, and proven by the
+  // tile counts. Returns false (and does nothing) if another thread got to it
+  // first, or the arena is full.
+  bool expand(node_idx_t idx, Board board, Color turn);
+
+  // Add a child to an expanded node, which has board and turn to move, for
+  // its untried move with the lowest square, and play that move on board.
+  // Returns NO_NODE (leaving board as is) if there's no untried move, or the
+  // arena is full.
+  node_idx_t add_child(node_idx_t idx, Board& board, Color turn);
+
+  // The child with the highest UCB1 value for turn, the player to move in
+  // node idx (or the first one that hasn't been visited yet), by the
+  // counters of their positions, but never a proven loss for turn unless all
+  // the children are. With a positive RAVE equivalence parameter k, a child's
+  // win rate is blended with its AMAF rate, which weighs sqrt(k / (3 * visits
+  // + k)): as much as the win rate at k visits, and less after that. With
+  // scores, a child's mean score replaces its win rate, and its exploration
+  // term shrinks with the variance of its scores (as in UCB1-Tuned), by the
+  // node's own counters. The node must have children.
+  node_idx_t select_child(node_idx_t idx, Color turn, double exploration, double rave = 0) const;
+
+  // The child with the most visits, i.e., the best move found by a search:
+  node_idx_t most_visited_child(node_idx_t idx) const;
+
+  // The child for move pos (zero for a pass), if it was expanded, or else NO_NODE:
+  node_idx_t find_child(node_idx_t idx, bits_t pos) const;
+
+  // Add win counts to a node and all its ancestors (and their positions):
+  void count_wins(node_idx_t idx, uint32_t d_wins, uint32_t l_wins);
+
+  // Add a playout's score for dark to a node and all its ancestors (only
+  // with scores):
+  void count_score(node_idx_t idx, uint32_t dark);
+
+  // Count a playout from node idx, with turn to move, in the AMAF counters
+  // of the children of idx and of all its ancestors whose move was played
+  // later on (on the way down to idx, or in the playout) by the same player
+  // (only with amaf):
+  void count_amaf(node_idx_t idx, Color turn, bits_t dark_moves, bits_t light_moves,
+                  bool d_won, bool l_won);
+
+  // Propagate the proof of node idx, with turn to move, to its ancestors, as
+  // far as it settles them: a parent is a win for its mover if this is, or
+  // else is proven once all its moves have proven children, by the best of
+  // them for its mover. Proofs are only ever set once, and the outcome of a
+  // position is fixed, so racing threads can only agree.
+  void propagate_proof(node_idx_t idx, Color turn);
+
+  // Take back visits of playouts that were abandoned, here and in all ancestors:
+  void cancel_visit(node_idx_t idx);
+
+  // Make a node the root, and discard all the nodes outside its subtree.
+  // The remaining nodes are compacted to the front of the arena, preserving
+  // their order. Not thread-safe.
+  void advance_root(node_idx_t idx);
+
+  // Discard the least visited subtrees, keeping at most max_nodes nodes,
+  // compacted like advance_root. A pruned child's move becomes untried again,
+  // so the search can grow it back if it turns out to matter. Returns the
+  // number of nodes discarded. Not thread-safe.
+  size_t prune(size_t max_nodes);
+
+  size_t size() const { return shared(size_).load(std::memory_order_relaxed); }
+  size_t capacity() const { return capacity_; }
+  bool full() const { return size() >= capacity_; }
+
+  // Memory use per node of capacity, including the scratch space for
+  // compaction, per node with a table (for its hash and entry), per position
+  // in the table, and per node with scores or AMAF counters:
+  static constexpr size_t NODE_BYTES = sizeof(MCTSNode) + sizeof(node_idx_t);
+  static constexpr size_t HASH_BYTES = sizeof(uint64_t) + sizeof(node_idx_t);
+  static constexpr size_t POSITION_BYTES = sizeof(Position);
+  static constexpr size_t SCORE_BYTES = sizeof(MCTSScore);
+  static constexpr size_t AMAF_BYTES = sizeof(uint64_t);
+
+ private:
+  MCTSNode* nodes_;
+  size_t capacity_;
+  size_t size_;        // Nodes allocated so far (from the front)
+  node_idx_t root_;
+  Board board_;        // The root's board
+  Color turn_;         // The player to move at the root
+  std::vector<node_idx_t> forward_;  // Scratch space for compaction
+  Position* positions_;  // Open addressing, with linear probing
+  size_t npositions_;
+  size_t nslots_;        // Positions in use, at the front (see size_table)
+  uint64_t* hashes_;     // The hash of each node's position (with a table), by index
+  node_idx_t* entries_;  // The table entry of each node (if any), by index
+  MCTSScore* scores_;    // The score of each node (if any), by index
+  uint64_t* amaf_;       // The AMAF playouts of each node (if any), and those
+                         // won by the player moving there in the upper half
+
+  // Allocate a block of n nodes, or return NO_NODE if the arena is full:
+  node_idx_t allocate(unsigned n);
+
+  // Construct a node, and add it to its position's entry (if there's room):
+  void make_node(node_idx_t idx, node_idx_t parent, uint8_t square, uint64_t hash);
+
+  // Find the table entry of a position, adding it if needed. Returns NO_NODE
+  // if the table is full around its slot.
+  node_idx_t find_position(uint64_t hash);
+
+  // Add a node to its position's entry, sharing the entry's counters between
+  // all its nodes once there's more than one:
+  void add_position(node_idx_t idx);
+
+  // Make a node use its position's shared counters, adding its own to them:
+  void share_position(node_idx_t idx);
+
+  // Resize the part of the table in use (which must be empty) for a tree
+  // that grows about as big as one of `nodes` nodes:
+  void size_table(size_t nodes);
+
+  // Keep the subtree of node idx, without the children that have fewer than
+  // min_visits visits (and their subtrees), and make idx the root:
+  void compact(node_idx_t idx, uint32_t min_visits);
 };
 
 } // namespace
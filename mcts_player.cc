@@ -3,30 +3,58 @@
  */
 
 #include "bits.hh"
+#include "kernels.hh"
 #include "mcts_player.hh"
 #include "moves.hh"
-#include "random_player.hh"
+#include "playouts.hh"
 
 #include <algorithm>
+#include <bit>
+#include <climits>
 #include <cstdlib>
+#include <iomanip>
 #include <iostream>
-#include <mutex>
+#include <random>
 #include <vector>
 
 namespace Othello {
 
 ////////////////////////////////////////////////////////////////////////////////
 // Checks the envrionment variable NTHREAD to set how many threads to use.
-// If it's not defined, just uses all available hardware threads.
-MCTSPlayer::MCTSPlayer(Color color, stop_ptr_t stop)
+// If it's not defined, or not a positive number, just uses all available
+// hardware threads (or one, if that's unknown).
+static unsigned
+thread_count()
+{
+  if (auto thread_str = getenv("NTHREAD")) {
+    char* end = nullptr;
+    const auto nthread = strtoul(thread_str, &end, 10);
+    if (end != thread_str && !*end && nthread > 0 && nthread <= UINT_MAX) {
+      return nthread;
+    }
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The pool gets a thread per search task, so that all tasks run at once.
+MCTSPlayer::MCTSPlayer(Color color, stop_ptr_t stop, MCTSConfig config, uint64_t seed)
 : Player(color),
   stop_(stop),
-  nthread_(std::thread::hardware_concurrency()),
-  pool_(nthread_)
+  config_(config),
+  nthread_(thread_count()),
+  pool_(nthread_),
+  rng_(seed? Xoshiro256(seed) : new_stream()),
+  halving_()
 {
-  if (auto thread_str = getenv("NTHREAD")) {
-    nthread_ = atoi(thread_str);
+  // A tree's table has room for a position per node:
+  const unsigned ntrees = (config_.parallel_ == Parallelism::ROOT)? nthread_ : 1;
+  const size_t capacity = config_.max_memory_ / node_bytes() / ntrees;
+  for (unsigned t = 0; t < ntrees; ++t) {
+    trees_.push_back(std::make_unique<MCTSTree>(capacity, config_.transpositions_? capacity : 0,
+                                                config_.scores_, config_.rave_ > 0));
   }
+  halving_ = std::make_unique<Halving[]>(ntrees);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -38,129 +66,468 @@ MCTSPlayer::~MCTSPlayer()
   std::clog.imbue(std::locale(""));
   std::clog << "Player " << (color_ == Color::DARK? "dark" : "light") <<
     " evaluated a total of " << total_plays_ << " games and " <<
-    total_moves_ << " moves" << std::endl;
+    total_moves_ << " moves with " << active_kernels().name_ << " kernels" <<
+    " (reused " << total_reused_ << " games from previous turns)" << std::endl;
+  const auto capacity = this->capacity();
+  const double MB = 1 << 20;
+  std::clog << std::setprecision(3) << "Player " << (color_ == Color::DARK? "dark" : "light") <<
+    " trees used up to " << peak_nodes_ * node_bytes() / MB << " of " <<
+    capacity * node_bytes() / MB << " MB (peak fill " <<
+    100. * peak_nodes_ / capacity << "%), and were pruned " <<
+    prunes_ << " times (" << total_pruned_ << " nodes); " << total_proven_ <<
+    " moves were proven wins or forced losses" << std::endl;
 #endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Create a vector of pairs of valid game moves and the board they'd cause if
-// that move is taken (an MCTSNode).
-MCTSPlayer::nodes_t
-MCTSPlayer::compute_nodes(Board board, bits_t moves) const
+size_t
+MCTSPlayer::capacity() const
+{
+  size_t capacity = 0;
+  for (const auto& tree : trees_) {
+    capacity += tree->capacity();
+  }
+  return capacity;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// In root parallelism, every tree gets an equal share of the budget. A round
+// per halving leaves a single move for the last one.
+void
+MCTSPlayer::start_halving(bits_t moves) const
 {
-  nodes_t nodes;
+  const unsigned nmoves = bits_set(moves);
+  const uint64_t budget = stop_->budget() / trees_.size();
+  const unsigned rounds = std::bit_width(nmoves - 1);
+  for (unsigned t = 0; t < trees_.size(); ++t) {
+    auto& halving = halving_[t];
+    halving.round_ = 0;
+    halving.survivors_ = moves;
+    halving.start_ = (*trees_[t])[trees_[t]->root()].visits();
+    halving.per_round_ = (config_.root_ == RootPolicy::HALVING && rounds)? budget / rounds : 0;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Draw a sample from a Beta(a, b) distribution. Two Gamma samples give an
+// exact one, but they cost more than a whole playout's worth of selection
+// for every child, so a posterior of many visits is approximated by a normal
+// distribution with the same mean and variance instead. Its standard normal
+// sample is the bit count of a random word, a Binomial(64, 1/2), centered.
+static double
+sample_beta(Xoshiro256& rng, double a, double b)
+{
+  constexpr double EXACT = 32;  // Below this many visits (plus two)
+  if (a + b < EXACT) {
+    const double x = std::gamma_distribution<double>(a)(rng);
+    const double y = std::gamma_distribution<double>(b)(rng);
+    return x / (x + y);
+  }
+  const double mean = a / (a + b);
+  const double normal = (std::popcount(rng()) - 32) / 4.;
+  return mean + normal * std::sqrt(mean * (1 - mean) / (a + b + 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// All the root's children exist by the time it gets here. A proven loss is
+// only picked when every child is one, like select_child does.
+// Thompson sampling draws each child's chance of winning from its posterior,
+// Beta(wins + 1, other visits + 1), and picks the best draw.
+// Sequential halving gives the surviving move with the fewest visits the
+// next visit, which keeps their visits even however many threads share the
+// root. The thread that sees a round's visits run out first advances the
+// round, and picks its survivors; other threads may still pick from the
+// previous round's survivors in the meantime, which only skews the counts a
+// little.
+node_idx_t
+MCTSPlayer::select_root(unsigned t, Xoshiro256& rng) const
+{
+  const auto& tree = *trees_[t];
+  const auto root = tree.root();
+  const auto turn = tree.root_turn();
+  const auto lost = win_for(opponent_of(turn));
+  auto& halving = halving_[t];
+
+  if (config_.root_ == RootPolicy::THOMPSON) {
+    node_idx_t best = NO_NODE;
+    double best_sample = -1;
+    for (auto child = tree[root].first_child(); child != NO_NODE; child = tree[child].next_sibling()) {
+      const auto& stats = tree.stats(child);
+      const double wins = stats.win_rate(turn) * std::max(1u, stats.visits());
+      const double sample = (tree[child].proof() == lost)? -0.5 :
+                            sample_beta(rng, wins + 1, stats.visits() - wins + 1);
+      if (sample > best_sample) {
+        best_sample = sample;
+        best = child;
+      }
+    }
+    return best;
+  }
+
+  if (!halving.per_round_) {
+    return tree.select_child(root, turn, config_.exploration_, config_.rave_);
+  }
+
+  auto round = halving.round_.load(std::memory_order_acquire);
+  auto survivors = halving.survivors_.load(std::memory_order_acquire);
+  const uint64_t visits = tree[root].visits() - halving.start_;
+  if (visits >= (round + 1) * halving.per_round_ && bits_set(survivors) > 1 &&
+      halving.round_.compare_exchange_strong(round, round + 1, std::memory_order_acq_rel)) {
+    std::pair<double, bits_t> ranked[N2];
+    unsigned n = 0;
+    for (auto child = tree[root].first_child(); child != NO_NODE; child = tree[child].next_sibling()) {
+      if (survivors & tree[child].original_move()) {
+        ranked[n++] = { tree.stats(child).win_rate(turn), tree[child].original_move() };
+      }
+    }
+    std::sort(ranked, ranked + n, std::greater<>());
+    survivors = 0;
+    for (unsigned i = 0; i < (n + 1) / 2; ++i) {
+      survivors |= ranked[i].second;
+    }
+    halving.survivors_.store(survivors, std::memory_order_release);
+  }
 
-  for (bits_t pos = 1; pos; pos <<= 1) {
-    if (moves & pos) {
-      const auto newb = effect_move(board, color_, pos);
-      nodes.push_back(MCTSNode(newb, opponent_of(color_), pos));
+  node_idx_t best = NO_NODE;
+  for (auto child = tree[root].first_child(); child != NO_NODE; child = tree[child].next_sibling()) {
+    if ((survivors & tree[child].original_move()) && tree[child].proof() != lost &&
+        (best == NO_NODE || tree[child].visits() < tree[best].visits())) {
+      best = child;
     }
   }
-  return nodes;
+  return (best != NO_NODE)? best : tree.select_child(root, turn, config_.exploration_, config_.rave_);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Given a subrange of nodes (moves and win records), pick the move that had the
-// most wins relative to games played from that node.
-bits_t
-MCTSPlayer::highest_win_odds(nodes_iter_t begin, nodes_iter_t end) const
+void
+MCTSPlayer::observe_root() const
+{
+  uint32_t visits[N2] = { 0 };
+  double wins[N2] = { 0 };
+  bits_t tried = 0;
+  for (const auto& tree : trees_) {
+    for (auto child = (*tree)[tree->root()].first_child(); child != NO_NODE;
+         child = (*tree)[child].next_sibling()) {
+      const auto& stats = tree->stats(child);
+      const auto square = pos2bit((*tree)[child].original_move());
+      visits[square] += stats.visits();
+      wins[square] += stats.win_rate(color_) * std::max(1u, stats.visits());
+      tried |= (*tree)[child].original_move();
+    }
+  }
+
+  RootStats stats;
+  stats.nmoves_ = bits_set(root_moves_);
+  for (; tried; tried &= tried - 1) {
+    const auto square = pos2bit(tried & -tried);
+    stats.squares_[stats.nchildren_] = square;
+    stats.visits_[stats.nchildren_] = visits[square];
+    stats.win_rates_[stats.nchildren_++] = wins[square] / std::max(1u, visits[square]);
+  }
+  stop_->observe(stats);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Every node on the way down gets a visit. A leaf is expanded on its second
+// visit, so leaves that are only reached once never pay for their moves.
+// Until all of an expanded node's moves have been tried, each visit adds a
+// child for one more of them and descends into it; that new child is the
+// leaf. If another thread is expanding a leaf at the same time (or the arena
+// is full), the playout just starts from the leaf itself. The descent also
+// stops at a proven node, whose outcome needs no playout. The root's
+// children are picked by the root policy.
+node_idx_t
+MCTSPlayer::select_leaf(unsigned t, Board& board, Color& turn, Xoshiro256& rng) const
 {
-  assert(std::distance(begin, end) > 0);
+  auto& tree = *trees_[t];
+  auto idx = tree.root();
+  board = tree.root_board();
+  turn = tree.root_turn();
+  tree.add_visit(idx);
 
-  const auto best = std::max_element(begin, end,
-      [&](const auto& n1, const auto& n2) {
-        return n1.win_odds(color_) < n2.win_odds(color_);
-      });
+  for (;;) {
+    if (tree[idx].proven()) {
+      break;
+    }
+    if (!tree[idx].expanded() && (tree[idx].visits() <= 1 || !tree.expand(idx, board, turn))) {
+      break;
+    }
+    auto child = tree.add_child(idx, board, turn);
+    if (child == NO_NODE) {
+      if (tree[idx].first_child() == NO_NODE) {
+        break;  // Terminal, or no room for a child
+      }
+      child = (idx == tree.root())? select_root(t, rng) :
+              tree.select_child(idx, turn, config_.exploration_, config_.rave_);
+      if (!tree[child].is_pass()) {
+        board = effect_move(board, turn, tree[child].original_move());
+      }
+    }
 
-  assert(best->win_odds(color_) >= 0);
-  return best->original_move();
+    idx = child;
+    turn = opponent_of(turn);
+    tree.add_visit(idx);
+  }
+  return idx;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// simulate games runs a loop until the external stop condition is triggered.
-// Througout the loop, it pits two random players against each other, starting
-// from a given board that is selected from a round-robin scan of all legal
-// moves from the current board (starting at a random choice of move).
-// After each simulated game, it records the game stats in local variables.
-// When the loop is done, all stats are added to member variables, under a lock.
+// search runs a loop until the external stop condition is triggered.
+// Througout the loop, it plays random games in a lock-step playout engine,
+// each starting from a leaf that was selected when its lane became free. The
+// outcome of each game is propagated from its leaf up to the root. Playouts
+// still in flight when the loop ends have their visits taken back.
+// A proven leaf skips its game (it's played from a full board, which ends at
+// once), and counts its exact outcome instead, then propagates its proof.
+// With scores, the outcome of every game is also counted as a score.
+// The loop also ends early if the tree fills up (see get_move), or once the
+// root is proven. A stop condition that watches the root's statistics gets
+// them every OBSERVE_PERIOD playouts of each thread.
+// Any number of threads can run this loop on the same tree concurrently.
 void
-MCTSPlayer::simulate_games(nodes_t& nodes, unsigned begin, unsigned end) const
+MCTSPlayer::search(unsigned t, Xoshiro256 rng) const
 {
-  std::mutex mut;
-  const int nmoves = end - begin;
-  assert(nmoves);
-  std::vector<uint64_t> d_wins(nmoves, 0);
-  std::vector<uint64_t> l_wins(nmoves, 0);
+  constexpr unsigned OBSERVE_PERIOD = 64;
+  StopCondition& stop = *stop_;
+  const bool observes = stop.observes();
+  unsigned unobserved = 0;
+  auto& tree = *trees_[t];
+  auto select_rng = rng.split();
+  PlayoutEngine engine(rng);
+  node_idx_t leaves[PLAYOUT_LANES];  // Leaf of each lane's game, by tag
+  Color turns[PLAYOUT_LANES];        // Player to move at each leaf
+  std::fill_n(leaves, PLAYOUT_LANES, NO_NODE);
 
 #ifdef BENCHMARK
-  int64_t plays = 0;
+  int64_t plays = 0, moves = 0;
 #endif
 
-  auto myp = RandomPlayer(color_);
-  auto opp = RandomPlayer(opponent_of(color_));
-  StopCondition& stop = *stop_;
-  int i = rand() % nmoves;  // Round-robin index into nodes
+  const auto next_game = [&]() {
+    const unsigned tag = std::find(leaves, leaves + PLAYOUT_LANES, NO_NODE) - leaves;
+    assert(tag < PLAYOUT_LANES);
+    Board board;
+    leaves[tag] = select_leaf(t, board, turns[tag], select_rng);
+    if (tree[leaves[tag]].proven()) {
+      board = Board(~bits_t(0), 0);
+    }
+#ifdef BENCHMARK
+    moves += board.moves_left();
+#endif
+    return Playout{ board, turns[tag], tag };
+  };
 
-  for (; !stop(); i = (i + 1) % nmoves) {
-    const auto tile_diff = play_game(nodes[begin + i].board(), &opp, &myp); // flip players
-    if (tile_diff > 0) {  // Record winner, if any:
-      d_wins[i]++;
-    } else if (tile_diff < 0) {
-      l_wins[i]++;
+  const auto record_game = [&](unsigned tag, int tile_diff, PlayedMoves played) {
+    if (const auto proof = tree[leaves[tag]].proof(); proof != Proof::UNKNOWN) {
+      tree.count_wins(leaves[tag], proof == Proof::DARK_WINS, proof == Proof::LIGHT_WINS);
+      if (config_.scores_) {
+        tree.count_score(leaves[tag], MCTSScore::dark_score(proof));
+      }
+      tree.propagate_proof(leaves[tag], turns[tag]);
+    } else {
+      tree.count_wins(leaves[tag], tile_diff > 0, tile_diff < 0);
+      if (config_.scores_) {
+        tree.count_score(leaves[tag], MCTSScore::dark_score(tile_diff, config_.margin_));
+      }
+      if (config_.rave_ > 0) {
+        tree.count_amaf(leaves[tag], turns[tag], played.dark_, played.light_,
+                        tile_diff > 0, tile_diff < 0);
+      }
     }
 #ifdef BENCHMARK
     plays++;
 #endif
+    leaves[tag] = NO_NODE;
+    if (observes && ++unobserved == OBSERVE_PERIOD) {
+      observe_root();
+      unobserved = 0;
+    }
+    return !stop() && !tree.full() && !tree[tree.root()].proven();
+  };
+
+  if (!stop() && !tree[tree.root()].proven()) {
+    engine.run(next_game, record_game);
   }
 
-  // Update final list of wins (thread-safe)
-  std::unique_lock guard(mut);
-  for (i = 0; i < nmoves; ++i) {
-    nodes[begin + i].count_wins(d_wins[i], l_wins[i]);
+  for (auto leaf : leaves) {
+    if (leaf != NO_NODE) {
+      tree.cancel_visit(leaf);
+    }
   }
 #ifdef BENCHMARK
   total_plays_ += plays;
-  total_moves_ += plays * nodes[0].board().moves_left();
+  total_moves_ += moves;
 #endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// get_move: compute the move with the highest aggregate probability of winning.
-// The main loop runs until the (external) stop condition is met. During this
-// time, it picks a random move from the available legal moves, and recursively
-// "makes" the move and continues with random moves of alternating players until
-// the game is over, recording who won. After the loop, the move that produced
-// the most wins is selected.
+// Passes aren't reported through notify_move, so the kept root may still be
+// at the board before a pass.
+node_idx_t
+MCTSPlayer::find_node(unsigned t, Board board, Color turn) const
+{
+  const auto& tree = *trees_[t];
+  if (tree.empty() || tree.root_board() != board) {
+    return NO_NODE;
+  }
+  return (tree.root_turn() == turn)? tree.root() : tree.find_child(tree.root(), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSPlayer::advance_root(unsigned t, node_idx_t node) const
+{
+  if (node == NO_NODE) {
+    trees_[t]->clear();
+  } else if (node != trees_[t]->root()) {
+    trees_[t]->advance_root(node);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSPlayer::notify_move(Board before, bits_t pos) const
+{
+  for (unsigned t = 0; t < trees_.size(); ++t) {
+    const auto node = find_node(t, before, opponent_of(color_));
+    advance_root(t, (node == NO_NODE)? NO_NODE : trees_[t]->find_child(node, pos));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+MCTSPlayer::game_over(Board) const
+{
+  for (auto& tree : trees_) {
+    tree->clear();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// get_move: build a UCT search tree from the current board until the
+// (external) stop condition is met, or the outcome of the game is proven,
+// and return the root's most visited move (among the proven wins, if any, or
+// else avoiding the proven losses, and with sequential halving, among the
+// moves that survived it).
+// The search starts from the tree kept from the previous turns, if it has
+// reached the current board, so its statistics aren't recomputed.
+// In tree parallelism, every pool thread runs its own search loop on the
+// shared tree, lock-free. In root parallelism, every thread searches its own
+// tree, and the visits of each move are summed over all the trees.
 // This version is multithreaded: it requires that StopCondition be thread-safe.
 bits_t
 MCTSPlayer::get_move(Board board, bits_t moves) const
 {
-  stop_->reset();
+  stop_->start_move(board.moves_left(), bits_set(moves));
 
-  auto nodes = compute_nodes(board, moves);
-  assert(nodes.size() >= bits_set(moves));
+  for (unsigned t = 0; t < trees_.size(); ++t) {
+    auto& tree = *trees_[t];
+    if (const auto node = find_node(t, board, color_); node != NO_NODE) {
+      advance_root(t, node);
+    } else {
+      tree.reset(board, color_);
+    }
+    if (!tree[tree.root()].expanded()) {
+      tree.expand(tree.root(), board, color_);
+    }
+    // Make sure there's at least one move to pick:
+    if (auto next = board; tree[tree.root()].first_child() == NO_NODE &&
+                           tree.add_child(tree.root(), next, color_) == NO_NODE) {
+      tree.reset(board, color_);  // No room left in the arena
+      tree.expand(tree.root(), board, color_);
+      tree.add_child(tree.root(), next, color_);
+    }
+#ifdef BENCHMARK
+    total_reused_ += tree[tree.root()].visits();
+#endif
+  }
+  start_halving(moves);
+  root_moves_ = moves;
+  if (stop_->observes()) {  // Before any playouts, e.g., to skip forced moves
+    observe_root();
+  }
 
-  const auto top_level = nodes.front().board().moves_left();
-  const auto bottom_level = nodes.back().board().moves_left();
-  const auto top_end = std::find_if_not(nodes.cbegin(), nodes.cend(),
-      [=](const MCTSNode& node){ return node.board().moves_left() == top_level; });
-  const auto bottom_begin = std::find_if(nodes.cbegin(), nodes.cend(),
-      [=](const MCTSNode& node){ return node.board().moves_left() == bottom_level; });
-  const auto bottom_idx = std::distance(nodes.cbegin(), bottom_begin);
-  const auto bottom_count = std::distance(bottom_begin, nodes.cend());
+  // When a tree fills up, its searches end early: the least visited half of
+  // the tree is then pruned, and all the searches resume.
+  for (size_t pruned = 1; pruned; ) {
+    // A random stream for every task, split off in a fixed order, so a search
+    // only depends on the player's seed (and on thread timing):
+    std::vector<Xoshiro256> streams;
+    while (streams.size() < nthread_) {
+      streams.push_back(rng_.split());
+    }
 
-  if (bottom_count >= nthread_ * 3) { // Enough workload to split up:
-    pool_.parallelize_loop(bottom_idx, bottom_idx + bottom_count, [&](unsigned b, unsigned e){
-        simulate_games(nodes, b, e); }, nthread_).wait();
-  }
-  else {
     for (unsigned t = 0; t < nthread_; t++) {
-       pool_.push_task([&](){ simulate_games(nodes, bottom_idx, bottom_idx + bottom_count); });
+      pool_.push_task([&, t](){ search(t % trees_.size(), streams[t]); });
     }
     pool_.wait_for_tasks();
+
+    pruned = 0;
+    for (auto& tree : trees_) {
+      if (tree->full()) {
+        if (const auto n = tree->prune(tree->capacity() / 2)) {
+          pruned += n;
+          prunes_++;
+        }
+      }
+    }
+#ifdef BENCHMARK
+    total_pruned_ += pruned;
+#endif
+  }
+  size_t nodes = 0;
+  for (const auto& tree : trees_) {
+    nodes += tree->size();
+  }
+  peak_nodes_ = std::max<size_t>(peak_nodes_, nodes);
+
+  // Sum the visits of every move over the roots' children (in root
+  // parallelism, a move may not have been tried in every tree):
+  uint64_t visits[N2] = { 0 };
+  bits_t tried = 0, won = 0, lost = 0;
+  for (const auto& tree : trees_) {
+    for (auto child = (*tree)[tree->root()].first_child(); child != NO_NODE;
+         child = (*tree)[child].next_sibling()) {
+      const auto pos = (*tree)[child].original_move();
+      visits[pos2bit(pos)] += (*tree)[child].visits();
+      tried |= pos;
+      if ((*tree)[child].proof() == win_for(color_)) {
+        won |= pos;
+      } else if ((*tree)[child].proof() == win_for(opponent_of(color_))) {
+        lost |= pos;
+      }
+    }
+  }
+  assert(tried && !(tried & ~moves));
+  // Sequential halving recommends the moves that survived it:
+  bits_t survivors = 0;
+  for (unsigned t = 0; t < trees_.size(); ++t) {
+    survivors |= halving_[t].per_round_? halving_[t].survivors_.load() : moves;
+  }
+  if (tried & survivors) {
+    tried &= survivors;
+  }
+  if (won) {
+    tried = won;
+  } else if (tried & ~lost) {
+    tried &= ~lost;
+  }
+#ifdef BENCHMARK
+  total_proven_ += (won || !(tried & ~lost));
+#endif
+  bits_t best = 0;
+  for (; tried; tried &= tried - 1) {
+    const auto pos = tried & -tried;
+    if (!best || visits[pos2bit(pos)] > visits[pos2bit(best)]) {
+      best = pos;
+    }
   }
 
-  return highest_win_odds(nodes.cbegin(), top_end);
+  // Keep only the subtrees under our move:
+  for (unsigned t = 0; t < trees_.size(); ++t) {
+    advance_root(t, trees_[t]->find_child(trees_[t]->root(), best));
+  }
+  stop_->finish_move();
+  return best;
 }
 
 } // namespace
@@ -7,53 +7,133 @@
 
 #include "mcts_node.hh"
 #include "player.hh"
+#include "prng.hh"
 #include "stop.hh"
 
 #include "BS_thread_pool.hpp"
 
-#include <random>
+#include <atomic>
+#include <memory>
 #include <vector>
 
 namespace Othello {
 
+// How the search threads share the work:
+enum class Parallelism {
+  TREE,  // All threads grow one shared tree
+  ROOT,  // Every thread grows its own tree; root statistics are summed at the end
+};
+
+// How the root's children are picked, once they've all been tried:
+enum class RootPolicy {
+  UCB1,      // Like every other node
+  THOMPSON,  // The highest sample of each child's Beta posterior of winning
+  HALVING,   // Sequential halving of the budget (only with a known budget)
+};
+
+// Search parameters (see bithello -h):
+struct MCTSConfig {
+  double exploration_ = 0.5;  // UCB1 exploration constant
+  double rave_ = 0;           // RAVE equivalence parameter (0 disables AMAF)
+  Parallelism parallel_ = Parallelism::TREE;
+  RootPolicy root_ = RootPolicy::UCB1;
+  size_t max_memory_ = size_t(256) << 20;  // Bytes for all the trees together
+  bool transpositions_ = false;  // Share statistics between transpositions
+  bool scores_ = false;          // Back up playout scores instead of win counts
+  double margin_ = 0.5;          // Weight of the tile margin in a score (see MCTSScore)
+};
+
 class MCTSPlayer : public Player {
  public:
 
-  // If seed is zero, some random value will be picked.
-  MCTSPlayer(Color color, stop_ptr_t stop);
+  // If seed is zero, the player gets a new stream (see new_stream).
+  MCTSPlayer(Color color, stop_ptr_t stop, MCTSConfig config = MCTSConfig(),
+             uint64_t seed = 0);
 
   virtual ~MCTSPlayer();
 
   virtual void display_board(Board) const {};
 
-  // Fetch the move with the best odds of winning based on MCTS:
+  // Fetch the most visited move of a UCT search:
   virtual bits_t get_move(Board b, bits_t moves) const;
 
-  virtual void notify_move(Board, bits_t) const {};
+  // Keep the subtree under the opponent's move for the next search:
+  virtual void notify_move(Board before, bits_t pos) const;
 
-  virtual void game_over(Board) const {};
+  virtual void game_over(Board) const;
 
- private:
-  using nodes_t = std::vector<MCTSNode>;
-  using nodes_iter_t = typename nodes_t::const_iterator;
+  // Tree memory use: the nodes all the trees can hold, the most nodes they
+  // held at the end of a search, and how many times pruning a full tree
+  // discarded any nodes:
+  size_t capacity() const;
+  size_t peak_nodes() const { return peak_nodes_; }
+  size_t prunes() const { return prunes_; }
 
+ private:
   stop_ptr_t stop_;
+  const MCTSConfig config_;
   unsigned nthread_;
   mutable BS::thread_pool pool_;
-
-  // Compute all nodes for a given starting board and legal moves:
-  nodes_t compute_nodes(Board board, bits_t moves) const;
-
-  // Return the move that is associated with the best odds of winning among nodes in a range
-  bits_t highest_win_odds(nodes_iter_t begin, nodes_iter_t end) const;
-
-  // Run a set of simulated games from current nodes and collect win statistics in nodes
-  void simulate_games(nodes_t& nodes, unsigned begin, unsigned end) const;
+  mutable Xoshiro256 rng_;  // Splits into a stream per search task
+  // Trees kept from previous turns: one per thread in root parallelism,
+  // otherwise just one. Each is empty until a search starts it.
+  std::vector<std::unique_ptr<MCTSTree>> trees_;
+
+  // The schedule of a sequential halving search of a tree's root: the
+  // budget is split evenly between rounds, and within a round, between the
+  // moves that survive it. After each round, the better half of the
+  // surviving moves (by win rate) survives to the next one.
+  struct Halving {
+    std::atomic<unsigned> round_ = 0;
+    std::atomic<bits_t> survivors_ = 0;
+    uint32_t start_ = 0;      // Root visits before the search
+    uint64_t per_round_ = 0;  // Root visits per round (0 when not halving)
+  };
+  std::unique_ptr<Halving[]> halving_;  // One per tree
+  mutable bits_t root_moves_ = 0;       // Legal moves of the current search
+  mutable size_t peak_nodes_ = 0;       // Most nodes in all the trees after a search
+  mutable size_t prunes_ = 0;           // Prunes of a full tree that discarded nodes
+
+  // The node of a tree for board with turn to move: the root, or its pass
+  // child. Returns NO_NODE if the tree doesn't match (e.g., after an undo).
+  node_idx_t find_node(unsigned tree, Board board, Color turn) const;
+
+  // Make a node of a tree its new root:
+  void advance_root(unsigned tree, node_idx_t node) const;
+
+  // Start a sequential halving schedule for each tree's root, if it's the
+  // root policy and the budget is known, over the legal moves:
+  void start_halving(bits_t moves) const;
+
+  // Show the stop condition the visits and win rates of the root's moves,
+  // summed over all the trees:
+  void observe_root() const;
+
+  // Pick the root's next child, by the root policy (rng is for sampling):
+  node_idx_t select_root(unsigned tree, Xoshiro256& rng) const;
+
+  // Descend from the root of a tree to a leaf to play out from, expanding it
+  // if needed. Also returns the leaf's board and player to move:
+  node_idx_t select_leaf(unsigned tree, Board& board, Color& turn, Xoshiro256& rng) const;
+
+  // Grow a tree with random playouts until the stop condition is met:
+  void search(unsigned tree, Xoshiro256 rng) const;
+
+  // Memory per node of a tree's capacity, with its hash and share of the
+  // positions table, its score, and its AMAF counters (those that are on):
+  size_t node_bytes() const
+  { return MCTSTree::NODE_BYTES +
+           (config_.transpositions_? MCTSTree::HASH_BYTES + MCTSTree::POSITION_BYTES : 0) +
+           (config_.scores_? MCTSTree::SCORE_BYTES : 0) +
+           (config_.rave_ > 0? MCTSTree::AMAF_BYTES : 0); }
 
  private:
 #ifdef BENCHMARK  // Benchmarking stat counters
-  mutable int64_t total_plays_ = 0;
-  mutable int64_t total_moves_ = 0;
+  mutable std::atomic<int64_t> total_plays_ = 0;
+  mutable std::atomic<int64_t> total_moves_ = 0;
+  mutable std::atomic<int64_t> total_reused_ = 0;  // Visits kept from previous turns
+  mutable size_t total_pruned_ = 0;  // Nodes discarded by pruning
+  mutable size_t total_proven_ = 0;  // Moves picked by a proven outcome
 #endif
 };
 
@@ -5,8 +5,10 @@
 
 #include "bits.hh"
 #include "board.hh"
+#include "kernels.hh"
 #include "moves.hh"
 #include "player.hh"
+#include "zobrist.hh"
 
 #include <iostream>
 
@@ -50,13 +52,22 @@ namespace Othello {
 
 ////////////////////////////////////////////////////////////////////////////////
 // Return a bitmap of all legal positions for a given player and a board.
-// Scans board in all 8 directions for valid positions and adds them to bitmap.
+// Scans board in all 8 directions for valid positions and adds them to bitmap,
+// using the fastest kernel for the running CPU (see kernels.hh).
 bits_t
 all_legal_moves(Board board, Color curp)
 {
   const bits_t mine = (curp == Color::DARK)? board.dark() : board.light();
   const bits_t theirs = (curp == Color::DARK)? board.light() : board.dark();
 
+  return active_kernels().legal_moves_(mine, theirs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FSM scan: each direction takes N serial steps over N (or NDIAG) lines.
+bits_t
+all_legal_moves_fsm(bits_t mine, bits_t theirs)
+{
   const bits_t ret =
       legal_moves(L_START, L2R, mine, theirs)
     | legal_moves(R_START, R2L, mine, theirs)
@@ -100,12 +111,39 @@ effect_move(const Board& board, Color curp, bits_t pos)
   return (curp == Color::DARK)? Board(newm, newt) : Board(newt, newm);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+Board
+effect_move(const Board& board, Color curp, bits_t pos, uint64_t& hash)
+{
+  const bits_t mine = (curp == Color::DARK)? board.dark() : board.light();
+  const bits_t theirs = (curp == Color::DARK)? board.light() : board.dark();
+
+  assert(pos && !(pos & (pos - 1)) && "Move position must be a single set bit");
+  assert(!((mine | theirs) & pos) && "Move position must be empty");
+
+  const bits_t bits_flipped = all_flipped(mine, theirs, pos);
+  assert(bits_flipped && "Can't effect a move that flips nothing!");
+  hash = zobrist_move(hash, curp, pos, bits_flipped);
+
+  const bits_t newm = (mine ^ bits_flipped) | pos;
+  const bits_t newt = theirs ^ bits_flipped;
+  return (curp == Color::DARK)? Board(newm, newt) : Board(newt, newm);
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // all_flipped returns a bitmap of all the positions that get flipped from
-// making a move at `pos`.
+// making a move at `pos`, using the fastest kernel for the running CPU.
 bits_t
 all_flipped(bits_t mine, bits_t theirs, bits_t pos)
+{
+  return active_kernels().flipped_(mine, theirs, pos);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Scan each ray from the move position, one piece at a time.
+bits_t
+all_flipped_scan(bits_t mine, bits_t theirs, bits_t pos)
 {
   return find_flipped(pos, mine, theirs, L2R)
        | find_flipped(pos, mine, theirs, R2L)
@@ -117,6 +155,58 @@ all_flipped(bits_t mine, bits_t theirs, bits_t pos)
        | find_flipped(pos, mine, theirs, TR2BL);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Step over the set bits of the legal moves (lowest first), and compute the
+// flips and new board of each move with the flip kernel.
+Children
+generate_children(Board board, Color curp, bits_t moves)
+{
+  const bits_t mine = (curp == Color::DARK)? board.dark() : board.light();
+  const bits_t theirs = (curp == Color::DARK)? board.light() : board.dark();
+  const auto flipped = active_kernels().flipped_;
+  Children ret;
+
+  assert(moves == all_legal_moves(board, curp) && "Must pass exactly all legal moves");
+  ret.moves_ = moves;
+  for (; moves; moves &= moves - 1) {
+    const bits_t pos = set(0ull, __builtin_ctzll(moves));
+    const bits_t flips = flipped(mine, theirs, pos);
+    const bits_t newm = (mine ^ flips) | pos;
+    const bits_t newt = theirs ^ flips;
+    ret.children_[ret.count_++] = { pos, flips,
+      (curp == Color::DARK)? Board(newm, newt) : Board(newt, newm) };
+  }
+
+  return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Children
+generate_children(Board board, Color curp)
+{
+  return generate_children(board, curp, all_legal_moves(board, curp));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Batched legal moves and moves: the boards' arrays hold either the current
+// player's pieces (mine) or the opponent's (theirs), depending on curp.
+void
+all_legal_moves(const BoardBatch& boards, Color curp, bits_t* moves)
+{
+  const bits_t* mine = (curp == Color::DARK)? boards.dark() : boards.light();
+  const bits_t* theirs = (curp == Color::DARK)? boards.light() : boards.dark();
+  active_kernels().legal_moves_batch_(mine, theirs, moves, boards.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void
+effect_move(BoardBatch& boards, Color curp, const bits_t* moves)
+{
+  bits_t* mine = (curp == Color::DARK)? boards.dark() : boards.light();
+  bits_t* theirs = (curp == Color::DARK)? boards.light() : boards.dark();
+  active_kernels().effect_move_batch_(mine, theirs, moves, boards.size());
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Run an interactive two-player game from a given starting point
 // Returns the difference between dark tiles and light tiles at the end.
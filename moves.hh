@@ -17,7 +17,12 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
 #include "board.hh"
+#include "kernels.hh"
 #include "player.hh"
 #include "scan.hh"
 
@@ -29,15 +34,81 @@ namespace Othello {
 // If the move is invalid, the initial board is returned.
 Board effect_move(const Board& board, Color curp, bits_t pos);
 
+// Same, and also update the position's Zobrist hash (see zobrist.hh) from
+// the flipped pieces:
+Board effect_move(const Board& board, Color curp, bits_t pos, uint64_t& hash);
+
+
+// Upper bound on the number of legal moves in any position: it can't exceed
+// the number of empty positions on a board with the four middle ones taken.
+constexpr idx_t MAX_MOVES = N2 - 4;
+
+// A legal move and its outcome, as produced by generate_children:
+struct Child {
+  bits_t move_;     // A single bit for the position of the move
+  bits_t flipped_;  // The opponent's pieces that the move flips
+  Board board_;     // The board after the move
+};
+
+// All the children of a board in increasing order of move position, stored
+// in place (no heap allocation).
+class Children {
+ public:
+  const Child* begin() const { return children_; }
+  const Child* end() const { return children_ + count_; }
+  idx_t size() const { return count_; }
+  bool empty() const { return !count_; }
+  const Child& operator[](idx_t i) const { assert(i < count_); return children_[i]; }
+
+  // Bitmap of all the moves:
+  bits_t moves() const { return moves_; }
+
+ private:
+  bits_t moves_ = 0;
+  idx_t count_ = 0;
+  Child children_[MAX_MOVES];
+
+  friend Children generate_children(Board, Color, bits_t);
+};
+
+// Enumerate all the legal moves of the current player, with the flips and
+// resulting board of each, in a single pass. If the legal moves are already
+// known, they can be passed in to skip their computation.
+Children generate_children(Board board, Color curp);
+Children generate_children(Board board, Color curp, bits_t moves);
+
+// Batched versions of all_legal_moves and effect_move, for the same player on
+// every board in a batch. They return the same results as the scalar ones
+// per board, but process many boards per call in the lanes of vector
+// registers. The first writes boards.size() bitmaps to moves. The second
+// effects moves[i] on boards[i] in place, where a zero move means a pass.
+void all_legal_moves(const BoardBatch& boards, Color curp, bits_t* moves);
+void effect_move(BoardBatch& boards, Color curp, const bits_t* moves);
 
 // Play a game till no more legal moves are available.
 // Returns a positive number if `me' wins, negative if opponent, 0 for tie.
 int play_game(Board board, player_ptr_t me, player_ptr_t opponent);
 
+// Play a game to the end for a simulation, with `turn' to move first: unlike
+// play_game, this is a plain loop with no players to notify and no undo, so
+// it inlines with the move policy. The policy picks one move out of a nonempty
+// bitmap of legal moves, called as policy(mine, theirs, moves).
+// Stops after two passes in a row, and returns dark minus light tiles.
+template <typename Policy>
+int playout(Board board, Color turn, Policy& policy);
+
 // Return a bitmap of all legal positions for a given player and a board.
 // Scans board in all 8 directions for valid positions and adds them to bitmap.
+// The generator is picked at run time for the CPU (see kernels.hh).
 bits_t all_legal_moves(Board board, Color curp);
 
+// The two portable generators behind all_legal_moves. Which one the scalar
+// kernel uses is chosen at compile time: the FSM scan by default, or the
+// occluded-fill scan if KOGGE_STONE is defined. Both return identical bitmaps.
+// The latter is inline, so it can also be vectorized across many boards.
+bits_t all_legal_moves_fsm(bits_t mine, bits_t theirs);
+constexpr inline bits_t all_legal_moves_fill(bits_t mine, bits_t theirs);
+
 /////////////////// Details:
 
 // Given a mask representing starting position for a scan, an operator next that
@@ -52,6 +123,16 @@ concept Next = requires(T a, bits_t b) {
 template <Next NEXT, Bitwise MASK, idx_t ITERS = N>
 constexpr inline bits_t legal_moves(MASK mask, NEXT next, bits_t mine, bits_t theirs);
 
+// Same result as legal_moves for direction next, but computed with a
+// Kogge-Stone occluded fill: log2(N) dependent steps on plain 64-bit masks.
+template <Next NEXT>
+constexpr inline bits_t fill_legal_moves(NEXT next, bits_t mine, bits_t theirs);
+
+// Propagate the bits of gen in direction next, through any contiguous run of
+// bits in pro, for up to N-1 positions. Returns gen with the filled positions.
+template <Next NEXT>
+constexpr inline bits_t occluded_fill(bits_t gen, bits_t pro, NEXT next);
+
 // Search in one direction, starting from a single bit `start` and advancing
 // each iteration using next, until we're either at the board's border or
 // we're no longer seeing opponent pieces. In that case, if the current piece
@@ -59,9 +140,21 @@ constexpr inline bits_t legal_moves(MASK mask, NEXT next, bits_t mine, bits_t th
 template <Next NEXT>
 constexpr inline bits_t find_flipped(bits_t start, bits_t mine, bits_t theirs, NEXT next);
 
+// Same result as find_flipped, but computed with an occluded fill from `start`
+// through the opponent's pieces, with no data-dependent branches.
+template <Next NEXT>
+constexpr inline bits_t fill_flipped(NEXT next, bits_t start, bits_t mine, bits_t theirs);
+
 // Rturn a bitmap of all the positions that get flipped from making a move at `pos`:
+// The implementation is picked at run time for the CPU (see kernels.hh).
 bits_t all_flipped(bits_t mine, bits_t theirs, bits_t pos);
 
+// The two portable implementations behind all_flipped: scanning rays one
+// piece at a time (default), or filling them (if KOGGE_STONE is defined).
+// The latter is inline, so it can also be vectorized across many boards.
+bits_t all_flipped_scan(bits_t mine, bits_t theirs, bits_t pos);
+constexpr inline bits_t all_flipped_fill(bits_t mine, bits_t theirs, bits_t pos);
+
 // Is the current position showing one of my pieces?
 constexpr inline bits_t is_mine(bits_t mine) {
   return mine;
@@ -197,6 +290,165 @@ constexpr inline bits_t inside(decltype(BR2TL))
   return ~ret;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Lookup tables to compute flips one whole line at a time, with no loops.
+// Every position lies on NLINES lines: its row, column, diagonal, and
+// anti-diagonal. Extracting the pieces on a line into consecutive bits (e.g.,
+// with BMI2's pext) gives an index of up to N bits, in which the position
+// itself is at line_index(). Then, given the opponent's pieces on that line,
+// an outflank table lists the positions where a piece of mine would close a
+// run of opponent pieces next to the position; and given the ones that do, a
+// flips table lists the pieces in between.
+
+constexpr idx_t NLINES = 4;
+
+// Bitmap of all the positions on a given line (0 to NLINES-1) through bit:
+constexpr inline bits_t
+line_mask(idx_t bit, idx_t line)
+{
+  constexpr int drow[NLINES] = { 0, 1, 1, 1 };
+  constexpr int dcol[NLINES] = { 1, 0, 1, -1 };
+  bits_t ret = 0;
+
+  for (int i = -int(N); i <= int(N); ++i) {
+    const int row = int(bit2row(bit)) + i * drow[line];
+    const int col = int(bit2col(bit)) + i * dcol[line];
+    if (row >= 0 && row < int(N) && col >= 0 && col < int(N)) {
+      ret = set(ret, row, col);
+    }
+  }
+  return ret;
+}
+
+// Index of bit among the extracted bits of its line:
+constexpr inline idx_t
+line_index(idx_t bit, idx_t line)
+{
+  return bits_set(line_mask(bit, line) & (set(0ull, bit) - 1));
+}
+
+// Indexed by position and line:
+template <typename T>
+using line_table_t = std::array<std::array<T, NLINES>, N2>;
+
+constexpr inline line_table_t<bits_t>
+line_masks()
+{
+  line_table_t<bits_t> ret{};
+  for (idx_t bit = 0; bit < N2; ++bit) {
+    for (idx_t line = 0; line < NLINES; ++line) {
+      ret[bit][line] = line_mask(bit, line);
+    }
+  }
+  return ret;
+}
+
+constexpr inline line_table_t<uint8_t>
+line_indices()
+{
+  line_table_t<uint8_t> ret{};
+  for (idx_t bit = 0; bit < N2; ++bit) {
+    for (idx_t line = 0; line < NLINES; ++line) {
+      ret[bit][line] = line_index(bit, line);
+    }
+  }
+  return ret;
+}
+
+// Indexed by the line index of the move, and the opponent's pieces on the
+// line's inner positions (1 to N-2), since the end positions can't be flipped.
+// Holds the first non-opponent position past each run next to the move.
+constexpr inline std::array<std::array<uint8_t, 1 << (N - 2)>, N>
+line_outflanks()
+{
+  std::array<std::array<uint8_t, 1 << (N - 2)>, N> ret{};
+  for (idx_t x = 0; x < N; ++x) {
+    for (idx_t inner = 0; inner < ret[x].size(); ++inner) {
+      const bits_t theirs = inner << 1;
+      idx_t up = x + 1;
+      while (up < N && test(theirs, up)) {
+        ++up;
+      }
+      if (up < N && up > x + 1) {
+        ret[x][inner] = set(ret[x][inner], up);
+      }
+      int down = int(x) - 1;
+      while (down >= 0 && test(theirs, down)) {
+        --down;
+      }
+      if (down >= 0 && down < int(x) - 1) {
+        ret[x][inner] = set(ret[x][inner], down);
+      }
+    }
+  }
+  return ret;
+}
+
+// Indexed by the line index of the move, and the outflanking pieces of mine
+// on the line. Holds all the positions between the move and those pieces.
+constexpr inline std::array<std::array<uint8_t, 1 << N>, N>
+line_flips()
+{
+  std::array<std::array<uint8_t, 1 << N>, N> ret{};
+  for (idx_t x = 0; x < N; ++x) {
+    for (idx_t outflank = 0; outflank < ret[x].size(); ++outflank) {
+      for (idx_t y = 0; y < N; ++y) {
+        if (test(outflank, y)) {
+          for (idx_t between = std::min(x, y) + 1; between < std::max(x, y); ++between) {
+            ret[x][outflank] = set(ret[x][outflank], between);
+          }
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+inline constexpr auto LINE_MASKS = line_masks();
+inline constexpr auto LINE_INDICES = line_indices();
+inline constexpr auto LINE_OUTFLANKS = line_outflanks();
+inline constexpr auto LINE_FLIPS = line_flips();
+
+////////////////////////////////////////////////////////////////////////////////
+// For every direction, the positions that can be reached from the previous
+// position without wrapping around to another row/column/diagonal.
+template <Next NEXT>
+constexpr inline bits_t
+reachable(NEXT)
+{
+  return NEXT()(inside(NEXT()));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Parallel-prefix fill: every step doubles the distance covered by the
+// previous steps, so three steps cover the longest run of 7 positions.
+template <Next NEXT>
+constexpr inline bits_t
+occluded_fill(bits_t gen, bits_t pro, NEXT next)
+{
+  const auto next2 = twice(next);
+  const auto next4 = twice(next2);
+
+  pro &= reachable(next);
+  gen |= pro & next(gen);
+  pro &= next(pro);
+  gen |= pro & next2(gen);
+  pro &= next2(pro);
+  gen |= pro & next4(gen);
+  return gen;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Fill from my pieces through the opponent's pieces; any empty position right
+// after a filled opponent piece is a valid move.
+template <Next NEXT>
+constexpr inline bits_t
+fill_legal_moves(NEXT next, bits_t mine, bits_t theirs)
+{
+  const bits_t filled = occluded_fill(mine, theirs, next);
+  return next(filled & theirs) & reachable(next) & ~(mine | theirs);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 template <Next NEXT>
 constexpr inline bits_t
@@ -219,6 +471,83 @@ find_flipped(bits_t start, bits_t mine, bits_t theirs, NEXT next)
   return (mask & mine)? ret : bits_t(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// The opponent's pieces filled from start are flipped if the position right
+// after them is mine (the mask is all ones in that case and zero otherwise).
+template <Next NEXT>
+constexpr inline bits_t
+fill_flipped(NEXT next, bits_t start, bits_t mine, bits_t theirs)
+{
+  const bits_t run = occluded_fill(start, theirs, next) & theirs;
+  const bits_t outflank = next(run | start) & reachable(next) & mine;
+  return run & -bits_t(outflank != 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Occluded-fill scan: each direction takes log2(N) steps, with no need for
+// the double-width diagonal masks.
+constexpr inline bits_t
+all_legal_moves_fill(bits_t mine, bits_t theirs)
+{
+  return fill_legal_moves(L2R, mine, theirs)
+       | fill_legal_moves(R2L, mine, theirs)
+       | fill_legal_moves(T2B, mine, theirs)
+       | fill_legal_moves(B2T, mine, theirs)
+       | fill_legal_moves(BL2TR, mine, theirs)
+       | fill_legal_moves(BR2TL, mine, theirs)
+       | fill_legal_moves(TR2BL, mine, theirs)
+       | fill_legal_moves(TL2BR, mine, theirs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The kernels are looked up once per game rather than per ply. Inlining the
+// portable occluded fills instead would be slower wherever vector or pext
+// kernels are available (see bench.cc).
+template <typename Policy>
+int
+playout(Board board, Color turn, Policy& policy)
+{
+  const bool dark = (turn == Color::DARK);
+  bits_t mine = dark? board.dark() : board.light();
+  bits_t theirs = dark? board.light() : board.dark();
+  unsigned plies = 0;
+  const auto legal_moves = active_kernels().legal_moves_;
+  const auto flipped_by = active_kernels().flipped_;
+
+  for (unsigned passes = 0; passes < 2; ++plies, std::swap(mine, theirs)) {
+    const bits_t moves = legal_moves(mine, theirs);
+    if (!moves) {
+      ++passes;
+      continue;
+    }
+    passes = 0;
+    const bits_t pos = policy(mine, theirs, moves);
+    assert(bits_set(pos) == 1 && (pos & moves));
+    const bits_t flipped = flipped_by(mine, theirs, pos);
+    mine ^= flipped | pos;
+    theirs ^= flipped;
+  }
+
+  // After an even number of plies, `mine' is back to the first player's:
+  const int diff = int(bits_set(mine)) - int(bits_set(theirs));
+  return (dark == (plies % 2 == 0))? diff : -diff;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Fill each ray from the move position, with no data-dependent branches.
+constexpr inline bits_t
+all_flipped_fill(bits_t mine, bits_t theirs, bits_t pos)
+{
+  return fill_flipped(L2R, pos, mine, theirs)
+       | fill_flipped(R2L, pos, mine, theirs)
+       | fill_flipped(T2B, pos, mine, theirs)
+       | fill_flipped(B2T, pos, mine, theirs)
+       | fill_flipped(BL2TR, pos, mine, theirs)
+       | fill_flipped(BR2TL, pos, mine, theirs)
+       | fill_flipped(TL2BR, pos, mine, theirs)
+       | fill_flipped(TR2BL, pos, mine, theirs);
+}
+
 
 
 } // namespace
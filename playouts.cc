@@ -0,0 +1,22 @@
+/*
+ * Lock-step playout engine: seeding of the lanes' random streams.
+ * The per-ply work is in the playout_ply_ kernels (kernels.cc).
+ */
+
+#include "playouts.hh"
+
+namespace Othello {
+
+////////////////////////////////////////////////////////////////////////////////
+PlayoutEngine::PlayoutEngine(Xoshiro256 rng, const Kernels& kernels)
+: ply_(kernels.playout_ply_)
+{
+  lanes_.rng_.seed(rng);
+  lanes_.rng_.next(lanes_.rnd_);
+  for (unsigned lane = 0; lane < PLAYOUT_LANES; ++lane) {
+    lanes_.passes_[lane] = 0;
+    lanes_.dark_moves_[lane] = 0;
+  }
+}
+
+} // namespace
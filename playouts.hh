@@ -0,0 +1,125 @@
+/*
+ * A playout engine that plays several independent random games in lock step.
+ * Each game occupies one lane of a small structure of arrays, and every ply
+ * advances all the lanes at once with a single vectorized kernel (legal moves,
+ * random move selection and flips; see playout_ply_ in kernels.hh).
+ * A game that has ended (two passes in a row) is reported to a sink, along
+ * with the squares each player played in it, and its lane is refilled with a
+ * new game from a source, so all lanes stay busy.
+ * An engine isn't thread-safe: use one per thread.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "bits.hh"
+#include "board.hh"
+#include "kernels.hh"
+#include "player.hh"
+#include "prng.hh"
+
+namespace Othello {
+
+// Number of games played in lock step: one AVX-512 register of bitboards,
+// or two AVX2 registers.
+constexpr unsigned PLAYOUT_LANES = 8;
+
+// The state of all the lanes, as separate arrays, so a ply kernel can load
+// each field of all the lanes straight into vector registers:
+struct PlayoutLanes {
+  alignas(64) bits_t mine_[PLAYOUT_LANES];      // Player to move
+  alignas(64) bits_t theirs_[PLAYOUT_LANES];    // Other player
+  alignas(64) uint64_t dark_[PLAYOUT_LANES];    // All ones if dark is to move
+  alignas(64) uint64_t passes_[PLAYOUT_LANES];  // Consecutive passes so far
+  alignas(64) uint64_t rnd_[PLAYOUT_LANES];     // Random word for this ply
+  alignas(64) bits_t dark_moves_[PLAYOUT_LANES];  // Squares dark played so far
+  XoshiroLanes<PLAYOUT_LANES> rng_;             // Per-lane random streams
+};
+
+// A new game for a lane: a starting board, the player to move, and a tag
+// that the sink gets back along with the outcome.
+struct Playout {
+  Board board_;
+  Color turn_;
+  unsigned tag_;
+};
+
+// The squares each player played in a game. A square is only ever played
+// once, so the squares played by light are the ones that were filled during
+// the game, but not by dark.
+struct PlayedMoves {
+  bits_t dark_;
+  bits_t light_;
+};
+
+class PlayoutEngine {
+ public:
+  // The lanes' random streams are all split off rng.
+  explicit PlayoutEngine(Xoshiro256 rng, const Kernels& kernels = active_kernels());
+  ~PlayoutEngine() = default;
+
+  // Keep playing games from source() (returns a Playout) till
+  // sink(tag, diff, played) returns false, where diff is the final count of
+  // dark minus light tiles, and played the game's PlayedMoves. Games still in
+  // progress when that happens are abandoned.
+  template <typename Source, typename Sink>
+  void run(Source source, Sink sink);
+
+ private:
+  PlayoutLanes lanes_;
+  unsigned tags_[PLAYOUT_LANES];
+  bits_t empty_[PLAYOUT_LANES];  // Empty squares at the start of each game
+  void (*ply_)(PlayoutLanes&);
+
+  void start(unsigned lane, const Playout& game)
+  {
+    const bool dark = (game.turn_ == Color::DARK);
+    lanes_.mine_[lane] = dark? game.board_.dark() : game.board_.light();
+    lanes_.theirs_[lane] = dark? game.board_.light() : game.board_.dark();
+    lanes_.dark_[lane] = -uint64_t(dark);
+    lanes_.passes_[lane] = 0;
+    lanes_.dark_moves_[lane] = 0;
+    tags_[lane] = game.tag_;
+    empty_[lane] = ~(game.board_.dark() | game.board_.light());
+  }
+
+  PlayedMoves played(unsigned lane) const
+  {
+    const bits_t filled = (lanes_.mine_[lane] | lanes_.theirs_[lane]) & empty_[lane];
+    return PlayedMoves{ lanes_.dark_moves_[lane], filled & ~lanes_.dark_moves_[lane] };
+  }
+
+  int tile_diff(unsigned lane) const
+  {
+    const int mine = bits_set(lanes_.mine_[lane]);
+    const int theirs = bits_set(lanes_.theirs_[lane]);
+    return lanes_.dark_[lane]? mine - theirs : theirs - mine;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Lanes are only checked for the end of their game between plies, which is
+// cheap next to a ply of all the lanes.
+template <typename Source, typename Sink>
+void
+PlayoutEngine::run(Source source, Sink sink)
+{
+  for (unsigned lane = 0; lane < PLAYOUT_LANES; ++lane) {
+    start(lane, source());
+  }
+
+  for (;;) {
+    ply_(lanes_);
+    for (unsigned lane = 0; lane < PLAYOUT_LANES; ++lane) {
+      if (lanes_.passes_[lane] >= 2) {
+        if (!sink(tags_[lane], tile_diff(lane), played(lane))) {
+          return;
+        }
+        start(lane, source());
+      }
+    }
+  }
+}
+
+} // namespace
@@ -0,0 +1,57 @@
+/*
+ * xoshiro256++ jumps and the process-wide master stream.
+ */
+
+#include "prng.hh"
+
+#include <cstdlib>
+#include <mutex>
+#include <random>
+
+namespace Othello {
+
+////////////////////////////////////////////////////////////////////////////////
+// Jump polynomial from the reference implementation (prng.di.unimi.it):
+// equivalent to 2^128 calls of operator().
+void
+Xoshiro256::jump()
+{
+  constexpr uint64_t JUMP[] = {
+    0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+
+  uint64_t s[4] = { 0, 0, 0, 0 };
+  for (auto word : JUMP) {
+    for (int b = 0; b < 64; ++b) {
+      if (word & (uint64_t(1) << b)) {
+        for (int i = 0; i < 4; ++i) {
+          s[i] ^= s_[i];
+        }
+      }
+      (*this)();
+    }
+  }
+  for (int i = 0; i < 4; ++i) {
+    s_[i] = s[i];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The master stream is seeded from the SEED environment variable if it's
+// defined, or else from the system's entropy source.
+Xoshiro256
+new_stream()
+{
+  static std::mutex mut;
+  static Xoshiro256 master([]() {
+      if (auto seed_str = getenv("SEED")) {
+        return uint64_t(strtoull(seed_str, nullptr, 0));
+      }
+      std::random_device rd;
+      return (uint64_t(rd()) << 32) | rd();
+    }());
+
+  std::unique_lock guard(mut);
+  return master.split();
+}
+
+} // namespace
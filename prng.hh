@@ -0,0 +1,126 @@
+/*
+ * Pseudo-random number generation for playouts and searches.
+ * The generator is xoshiro256++ (Blackman and Vigna), with a jump function
+ * that splits it into up to 2^128 non-overlapping streams: one per player,
+ * per search thread, and per playout lane. All the streams in a process are
+ * split off a single master stream, whose seed comes from the SEED environment
+ * variable (if set), so a whole run can be reproduced from one seed.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace Othello {
+
+// Expand a seed into a sequence of well-mixed words (for seeding only):
+constexpr uint64_t
+splitmix64(uint64_t& state)
+{
+  uint64_t z = (state += 0x9E3779B97F4A7C15);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+  return z ^ (z >> 31);
+}
+
+constexpr uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+////////////////////////////////////////////////////////////////////////////////
+// A single xoshiro256++ stream. It's also a standard uniform random bit
+// generator, for the distributions of <random>.
+class Xoshiro256 {
+ public:
+  using result_type = uint64_t;
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return ~result_type(0); }
+
+  explicit Xoshiro256(uint64_t seed)
+  {
+    for (auto& s : s_) {
+      s = splitmix64(seed);
+    }
+  }
+
+  Xoshiro256(uint64_t s0, uint64_t s1, uint64_t s2, uint64_t s3) : s_{ s0, s1, s2, s3 } {}
+
+  // Next random word:
+  uint64_t operator()()
+  {
+    const uint64_t result = rotl(s_[0] + s_[3], 23) + s_[0];
+    const uint64_t t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = rotl(s_[3], 45);
+    return result;
+  }
+
+  // Advance by 2^128 words:
+  void jump();
+
+  // Return the current stream, and jump this one past it:
+  Xoshiro256 split()
+  {
+    const auto ret = *this;
+    jump();
+    return ret;
+  }
+
+  uint64_t state(unsigned i) const { return s_[i]; }
+
+ private:
+  uint64_t s_[4];
+};
+
+// A new stream split off the process's master stream (thread-safe):
+Xoshiro256 new_stream();
+
+////////////////////////////////////////////////////////////////////////////////
+// LANES independent xoshiro256++ streams, stored by state word, so that
+// advancing all of them in a loop vectorizes: 4 streams per AVX2 register,
+// or 8 per AVX-512 register. Lane i yields the same words as the i-th
+// stream split off the generator it's seeded from.
+template <unsigned LANES>
+struct XoshiroLanes {
+  alignas(64) uint64_t s0_[LANES];
+  alignas(64) uint64_t s1_[LANES];
+  alignas(64) uint64_t s2_[LANES];
+  alignas(64) uint64_t s3_[LANES];
+
+  void seed(Xoshiro256& streams)
+  {
+    for (unsigned lane = 0; lane < LANES; ++lane) {
+      const auto stream = streams.split();
+      s0_[lane] = stream.state(0);
+      s1_[lane] = stream.state(1);
+      s2_[lane] = stream.state(2);
+      s3_[lane] = stream.state(3);
+    }
+  }
+
+  // Next random word of one lane; call in a loop over all lanes to vectorize:
+  uint64_t next(unsigned lane)
+  {
+    const uint64_t result = rotl(s0_[lane] + s3_[lane], 23) + s0_[lane];
+    const uint64_t t = s1_[lane] << 17;
+    s2_[lane] ^= s0_[lane];
+    s3_[lane] ^= s1_[lane];
+    s1_[lane] ^= s2_[lane];
+    s0_[lane] ^= s3_[lane];
+    s2_[lane] ^= t;
+    s3_[lane] = rotl(s3_[lane], 45);
+    return result;
+  }
+
+  // Next random word of every lane, LANES outputs per call:
+  void next(uint64_t* out)
+  {
+    for (unsigned lane = 0; lane < LANES; ++lane) {
+      out[lane] = next(lane);
+    }
+  }
+};
+
+} // namespace
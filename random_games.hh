@@ -0,0 +1,45 @@
+/*
+ * A driver for pseudo-random games, to collect positions for tests and
+ * benchmarks of the move kernels. It only uses the reference (scan and FSM)
+ * move functions, so it doesn't depend on the kernels under test.
+ */
+
+#pragma once
+
+#include <utility>
+
+#include "bits.hh"
+#include "kernels.hh"
+#include "moves.hh"
+#include "prng.hh"
+
+namespace Othello {
+
+// Play ngames random games from the initial board, with moves drawn from rng,
+// and call visit(mine, theirs, moves) on every position along the way (for
+// the player to move, whose legal moves are `moves`, zero for a pass).
+template <typename Visit>
+void
+play_random_games(unsigned ngames, Xoshiro256& rng, Visit visit)
+{
+  for (unsigned game = 0; game < ngames; ++game) {
+    bits_t mine = setpos(3, 4) | setpos(4, 3);
+    bits_t theirs = setpos(3, 3) | setpos(4, 4);
+    for (unsigned passes = 0; passes < 2; std::swap(mine, theirs)) {
+      const auto moves = all_legal_moves_fsm(mine, theirs);
+      visit(mine, theirs, moves);
+      if (!moves) {
+        ++passes;
+        continue;
+      }
+      passes = 0;
+
+      const bits_t pos = kernels_for(Isa::SCALAR).select_move_(moves, rng());
+      const bits_t flipped = all_flipped_scan(mine, theirs, pos);
+      mine ^= flipped | pos;
+      theirs ^= flipped;
+    }
+  }
+}
+
+} // namespace
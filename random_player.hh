@@ -4,13 +4,15 @@
 
 #pragma once
 
+#include "kernels.hh"
 #include "player.hh"
+#include "prng.hh"
 
 namespace Othello {
 
 class RandomPlayer : public Player {
  public:
-   // If seed is zero, some random value will be picked.
+  // If seed is zero, the player gets a new stream (see new_stream).
   RandomPlayer(Color color, uint64_t seed = 0);
   virtual ~RandomPlayer() = default;
 
@@ -24,9 +26,26 @@ class RandomPlayer : public Player {
   virtual void game_over(Board) const {};
 
  private:
-  mutable __uint128_t rstate_; // PRNG state
+  mutable Xoshiro256 rng_;
+};
+
+// A move policy for playout() (see moves.hh) that picks the same moves as a
+// RandomPlayer with the same stream, but without a virtual get_move, and with
+// the selection kernel looked up only once.
+class RandomPolicy {
+ public:
+  explicit RandomPolicy(Xoshiro256 rng)
+  : rng_(rng), select_move_(active_kernels().select_move_)
+  {}
 
-  uint64_t lehmer64() const; // Lehmer's PRNG
+  bits_t operator()(bits_t, bits_t, bits_t moves)
+  {
+    return select_move_(moves, rng_());
+  }
+
+ private:
+  Xoshiro256 rng_;
+  bits_t (*select_move_)(bits_t moves, uint64_t rnd);
 };
 
 } // namespace
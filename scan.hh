@@ -84,6 +84,13 @@ struct bit_shl
   constexpr T operator()(const T& bits) const { return bits << COUNT; }
 };
 
+// The same traversal direction, advancing two positions at a time:
+template <idx_t COUNT>
+constexpr auto twice(bit_shr<COUNT>) { return bit_shr<2 * COUNT>(); }
+
+template <idx_t COUNT>
+constexpr auto twice(bit_shl<COUNT>) { return bit_shl<2 * COUNT>(); }
+
 
 // Helpers to compute the starting points for diagonal scans into either
 // a DB_lo struct (when scanning from bottom to top) or DB_hi (top to bottom).
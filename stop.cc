@@ -4,10 +4,85 @@
 
 #include "stop.hh"
 
+#include <algorithm>
+#include <cmath>
+
 using namespace std::chrono;
 
 namespace Othello {
 
+// A thread's reservations of checks, each for the search of some generation
+// of some instance, and the one it used last:
+static thread_local struct {
+  struct {
+    const StopByMoves* owner_ = nullptr;
+    uint64_t generation_ = 0;
+    uint64_t left_ = 0;
+  } slots_[StopByMoves::MAX_INSTANCES];
+  unsigned last_ = 0;
+  unsigned next_ = 0;  // The next slot to give up, round-robin
+} reservations;
+
+///////////////////////////////////////////////////////
+uint64_t
+StopByMoves::next_generation()
+{
+  static std::atomic<uint64_t> generations = 0;
+  return ++generations;
+}
+
+///////////////////////////////////////////////////////
+// A new reservation takes about 1/64 of the checks that are left, so that
+// the last ones are spread over the threads instead of going to one of them.
+// An instance's slot is found by its address, and is only valid for its
+// current generation (the address may be reused by a later instance). A new
+// instance takes a slot with nothing left in it, if any, or else the next
+// one in turn.
+bool
+StopByMoves::operator()()
+{
+  const auto generation = generation_.load(std::memory_order_relaxed);
+  auto& slots = reservations.slots_;
+  auto* slot = &slots[reservations.last_];
+  if (slot->owner_ != this) {
+    slot = nullptr;
+    for (unsigned i = 0; i < MAX_INSTANCES && !slot; ++i) {
+      if (slots[i].owner_ == this) {
+        slot = &slots[reservations.last_ = i];
+      }
+    }
+  }
+  if (slot && slot->generation_ == generation && slot->left_) {
+    --slot->left_;
+    return false;
+  }
+
+  auto reserved = reserved_.load(std::memory_order_relaxed);
+  uint64_t chunk;
+  do {
+    if (reserved + 1 >= max_moves_) {
+      return true;
+    }
+    chunk = std::clamp<uint64_t>((max_moves_ - 1 - reserved) / 64, 1, MAX_CHUNK);
+  } while (!reserved_.compare_exchange_weak(reserved, reserved + chunk, std::memory_order_relaxed));
+
+  if (!slot) {
+    unsigned i = 0;
+    while (i < MAX_INSTANCES && slots[i].left_) {
+      ++i;
+    }
+    if (i == MAX_INSTANCES) {
+      i = reservations.next_;
+      reservations.next_ = (i + 1) % MAX_INSTANCES;
+    }
+    slot = &slots[reservations.last_ = i];
+    slot->owner_ = this;
+  }
+  slot->generation_ = generation;
+  slot->left_ = chunk - 1;
+  return false;
+}
+
 void
 StopByDuration::reset()
 {
@@ -27,4 +102,174 @@ StopByDuration::~StopByDuration()
 {
 }
 
+///////////////////////////////////////////////////////
+void
+StopByConfidence::reset()
+{
+  budget_->reset();
+  decided_ = false;
+}
+
+///////////////////////////////////////////////////////
+void
+StopByConfidence::start_move(unsigned moves_left, unsigned nmoves)
+{
+  budget_->start_move(moves_left, nmoves);
+  decided_ = false;
+}
+
+///////////////////////////////////////////////////////
+// The other condition is checked even once decided, so that it counts every
+// playout.
+bool
+StopByConfidence::operator()()
+{
+  return (*budget_)() || decided_.load(std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////
+// The leader is separated from another move when the difference of their
+// win rates is above `confidence` standard errors of that difference. A win
+// rate's variance is that of a Bernoulli variable with the same rate,
+// smoothed by a win and a loss (so that a move that has never lost still has
+// some uncertainty).
+void
+StopByConfidence::observe(const RootStats& stats)
+{
+  if (budget_->observes()) {
+    budget_->observe(stats);
+  }
+  if (stats.nmoves_ <= 1) {
+    decided_ = true;
+    return;
+  }
+  if (!stats.nchildren_) {
+    return;
+  }
+
+  unsigned leader = 0;
+  for (unsigned i = 1; i < stats.nchildren_; ++i) {
+    if (stats.visits_[i] > stats.visits_[leader]) {
+      leader = i;
+    }
+  }
+  const auto variance = [&](unsigned i) {
+    const double n = stats.visits_[i] + 2;
+    const double p = (stats.win_rates_[i] * stats.visits_[i] + 1) / n;
+    return p * (1 - p) / n;
+  };
+  uint32_t runner_up = 0;
+  bool separated = stats.nchildren_ == stats.nmoves_ && stats.visits_[leader] >= min_visits_;
+  for (unsigned i = 0; i < stats.nchildren_; ++i) {
+    if (i != leader) {
+      runner_up = std::max(runner_up, stats.visits_[i]);
+      separated &= stats.win_rates_[leader] - stats.win_rates_[i] >
+                   confidence_ * std::sqrt(variance(leader) + variance(i));
+    }
+  }
+
+  const auto budget = budget_->budget();
+  const auto used = budget_->used();
+  if (separated || (budget && stats.visits_[leader] - runner_up > std::max(budget, used) - used)) {
+    decided_ = true;
+  }
+}
+
+///////////////////////////////////////////////////////
+StopByClock::StopByClock(duration_t total, duration_t increment)
+: total_(total), increment_(increment), remaining_(total_), begin_()
+{
+}
+
+///////////////////////////////////////////////////////
+// Full weight between 44 and 16 empty squares, tapering off linearly to
+// 0.3 in the first and the last moves.
+double
+StopByClock::phase_weight(unsigned moves_left)
+{
+  constexpr double MIN_WEIGHT = 0.3;
+  constexpr unsigned MIDGAME = 44, ENDGAME = 16;
+  if (moves_left > MIDGAME) {
+    return 1 - (1 - MIN_WEIGHT) * std::min(1., double(moves_left - MIDGAME) / (N2 - 4 - MIDGAME));
+  }
+  if (moves_left < ENDGAME) {
+    return MIN_WEIGHT + (1 - MIN_WEIGHT) * double(moves_left) / ENDGAME;
+  }
+  return 1;
+}
+
+///////////////////////////////////////////////////////
+void
+StopByClock::reset()
+{
+  begin_ = Clock::now();
+  used_ = Clock::duration(0);
+  last_change_ = 0;
+  leader_ = N2;
+}
+
+///////////////////////////////////////////////////////
+// The player moves on about every other empty square, so the time left (with
+// the increments still to come) is split between those moves by their phase
+// weights. The hard limit keeps a few shares of the time left for later.
+void
+StopByClock::start_move(unsigned moves_left, unsigned nmoves)
+{
+  if (moves_left >= moves_left_) {
+    remaining_ = total_;
+  } else {
+    remaining_ -= used_;
+    remaining_ = std::max(remaining_, Clock::duration(0)) + increment_;
+  }
+  moves_left_ = moves_left;
+
+  double weights = 0;
+  unsigned my_moves = 0;
+  for (unsigned left = moves_left; left > 0; left -= std::min(left, 2u)) {
+    weights += phase_weight(left);
+    ++my_moves;
+  }
+  const auto available = remaining_ + increment_ * (std::max(my_moves, 1u) - 1);
+  const double share = phase_weight(moves_left) / std::max(weights, 1e-9) *
+                       std::min(1., nmoves / 4.) * (nmoves > 1);
+  soft_ = std::chrono::duration_cast<Clock::duration>(available * share);
+  hard_ = std::min(3 * soft_, remaining_ / 3 + increment_);
+  soft_ = std::min(soft_, hard_);
+  reset();
+}
+
+///////////////////////////////////////////////////////
+bool
+StopByClock::operator()()
+{
+  const auto elapsed = Clock::now() - begin_;
+  if (elapsed >= hard_) {
+    return true;
+  }
+  return elapsed >= soft_ &&
+         Clock::duration(last_change_.load(std::memory_order_relaxed)) < soft_ / 2;
+}
+
+///////////////////////////////////////////////////////
+void
+StopByClock::finish_move()
+{
+  used_ = Clock::now() - begin_;
+}
+
+///////////////////////////////////////////////////////
+void
+StopByClock::observe(const RootStats& stats)
+{
+  unsigned leader = 0;
+  for (unsigned i = 1; i < stats.nchildren_; ++i) {
+    if (stats.visits_[i] > stats.visits_[leader]) {
+      leader = i;
+    }
+  }
+  if (stats.nchildren_ && leader_.exchange(stats.squares_[leader]) != stats.squares_[leader]) {
+    last_change_.store((Clock::now() - begin_).count(), std::memory_order_relaxed);
+  }
+}
+
 } // namespace
@@ -2,7 +2,9 @@
  * Abstract base class and several implementations for a function object that
  * determines when the search for moves should stop.
  * Only two operations are supported: resetting for a new move, and checking for
- * the stopping condition (after every move search).
+ * the stopping condition (after every move search). A condition can also ask
+ * to watch the statistics of the root's moves as the search goes on, and
+ * hear when the move has been picked.
  * All of these classes need to be thread-safe.
  */
 
@@ -10,27 +12,75 @@
 
 #include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <memory>
 
+#include "bits.hh"
+
 namespace Othello {
 
+// The root's children, with their squares, visits and win rates for the
+// player to move, and the number of legal moves at the root (some of which
+// may not have a child yet):
+struct RootStats {
+  unsigned nmoves_ = 0;
+  unsigned nchildren_ = 0;
+  uint8_t squares_[N2];
+  uint32_t visits_[N2];
+  double win_rates_[N2];
+};
+
 struct StopCondition {
   virtual void reset() = 0;            // Start a brand-new search
+  // Start the search of a move, with moves_left empty squares and nmoves legal moves:
+  virtual void start_move(unsigned /* moves_left */, unsigned /* nmoves */) { reset(); }
   virtual bool operator()() = 0;       // Should MC search stop now?
+  virtual uint64_t budget() const { return 0; }  // Checks per search, if known (else 0)
+  virtual uint64_t used() const { return 0; }    // Checks of this search, if counted
+  virtual bool observes() const { return false; }  // Does it want observe calls?
+  virtual void observe(const RootStats&) {}  // The root's statistics, now and then
+  virtual void finish_move() {}        // The move was picked, right before it's played
   virtual ~StopCondition() = default;
 };
 
 /////////////////////////////////////
-// This class stops search after a given set of moves
+// This class stops search after a given set of moves: the first max_moves - 1
+// checks of a search go on, and the rest stop.
+// Rather than counting every check on one shared counter, each thread
+// reserves a chunk of checks at a time (up to MAX_CHUNK, and less as the
+// budget runs out), and counts them down privately. The count stays exact:
+// reservations never exceed the budget, and a thread stops only once its own
+// reservation is used up and nothing's left to reserve. So threads may stop
+// at slightly different times, at most MAX_CHUNK checks apart, but never
+// overshoot the budget; a reservation that a thread doesn't use up (e.g., if
+// its search ends for another reason) is never counted.
+// A thread keeps a reservation per instance, for up to MAX_INSTANCES instances
+// that it checks in turn (e.g., composed or shared conditions). Checking more
+// than that drops the reservations of the least recently refilled ones, which
+// then stop early (but still never late).
 class StopByMoves : public StopCondition {
-  std::atomic<uint64_t> count_ = 0;
-  const uint64_t max_moves_;
-
  public:
-  StopByMoves(uint64_t max_moves = 1000) : max_moves_(max_moves) {}
+  static constexpr uint64_t MAX_CHUNK = 256;
+  static constexpr unsigned MAX_INSTANCES = 8;
+
+  StopByMoves(uint64_t max_moves = 1000) : generation_(next_generation()), max_moves_(max_moves) {}
   virtual ~StopByMoves() = default;
-  virtual void reset() { count_ = 0; }
-  virtual bool operator()() { return ++count_ >= max_moves_; }
+  virtual void reset() { reserved_ = 0; generation_ = next_generation(); }
+  virtual bool operator()();
+  virtual uint64_t budget() const { return max_moves_; }
+  virtual uint64_t used() const { return reserved(); }  // Slightly ahead of the checks
+
+  // Checks of the current search reserved by all the threads so far:
+  uint64_t reserved() const { return reserved_.load(std::memory_order_relaxed); }
+
+ private:
+  // Each search of each instance gets a unique generation, so a thread's
+  // reservation can't outlive it:
+  static uint64_t next_generation();
+
+  alignas(64) std::atomic<uint64_t> reserved_ = 0;
+  alignas(64) std::atomic<uint64_t> generation_;  // Only written between searches
+  const uint64_t max_moves_;
 };
 
 
@@ -50,5 +100,80 @@ class StopByDuration : public StopCondition {
   virtual bool operator()();
 };
 
+/////////////////////////////////////
+// This class stops search when another condition does, or earlier, as soon
+// as the most visited move is sure to remain so: when there's only one legal
+// move, when the runner-up's visits can't catch up with the leader's in the
+// rest of the other condition's budget (if it counts its checks), or when all
+// the moves have been tried, and the leader's win rate is above every other
+// move's by more than `confidence` standard errors of each (with at least
+// min_visits visits). The checks are counted by the other condition only.
+class StopByConfidence : public StopCondition {
+  stop_ptr_t budget_;
+  const double confidence_;
+  const uint32_t min_visits_;
+  std::atomic<bool> decided_ = false;
+
+ public:
+  StopByConfidence(stop_ptr_t budget, double confidence = 3, uint32_t min_visits = 1000)
+  : budget_(budget), confidence_(confidence), min_visits_(min_visits) {}
+  virtual ~StopByConfidence() = default;
+  virtual void reset();
+  virtual void start_move(unsigned moves_left, unsigned nmoves);
+  virtual bool operator()();
+  virtual uint64_t budget() const { return budget_->budget(); }
+  virtual uint64_t used() const { return budget_->used(); }
+  virtual bool observes() const { return true; }
+  virtual void observe(const RootStats& stats);
+  virtual void finish_move() { budget_->finish_move(); }
+};
+
+/////////////////////////////////////
+// This class manages a game clock of `total` milliseconds per player, plus
+// an increment after every move, by giving each move a share of the time
+// left. The share of a move depends on the phase of the game: the opening
+// and the last few moves get less time than the mid-game (see phase_weight),
+// and a move with few legal moves gets less too (a forced one gets none).
+// A search stops at its share, unless the most visited move changed in the
+// second half of it; then it goes on, until the move settles or up to a
+// hard limit of a few shares.
+// The time a move took, from start_move to finish_move (so including the
+// player's work before and after the search), is charged to the clock when
+// the next one starts. A move with more empty squares
+// than the last one starts a new game, with a full clock.
+class StopByClock : public StopCondition {
+ public:
+  using duration_t = std::chrono::duration<uint64_t, std::milli>;
+  using Clock = std::chrono::steady_clock;
+
+  StopByClock(duration_t total, duration_t increment = duration_t(0));
+  virtual ~StopByClock() = default;
+  virtual void reset();
+  virtual void start_move(unsigned moves_left, unsigned nmoves);
+  virtual bool operator()();
+  virtual bool observes() const { return true; }
+  virtual void observe(const RootStats& stats);
+  virtual void finish_move();
+
+  // The relative time to spend on a move with moves_left empty squares:
+  static double phase_weight(unsigned moves_left);
+
+  Clock::duration remaining() const { return remaining_; }  // Before this move
+  Clock::duration soft_limit() const { return soft_; }       // Of this move
+  Clock::duration hard_limit() const { return hard_; }
+
+ private:
+  const Clock::duration total_;
+  const Clock::duration increment_;
+  Clock::duration remaining_;
+  Clock::duration soft_ = Clock::duration(0);
+  Clock::duration hard_ = Clock::duration(0);
+  unsigned moves_left_ = 0;              // Of the last move (0 for none yet)
+  Clock::time_point begin_;
+  Clock::duration used_ = Clock::duration(0);  // By the last move, once finished
+  std::atomic<Clock::rep> last_change_ = 0;  // Time the leading move last changed
+  std::atomic<unsigned> leader_ = N2;          // Square of the most visited move
+};
+
 
 } // namespace
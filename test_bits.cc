@@ -64,3 +64,42 @@ TEST_CASE( "DB_lo shifts left correctly", "[bits]" ) {
   REQUIRE(((db << (N2-1)) & 0xFFFFFFFFFFFFFFFFULL) != 0);
   REQUIRE((((db >> (N2-1)) << (N2-1)) & 0xFFFFFFFFFFFFFFFFULL) == 0);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "nth_set_bit finds each set bit in order", "[bits]" ) {
+  bits_t bits = 0x8000'0000'0000'0001;
+  for (int i = 0; i < 1000; ++i) {
+    idx_t n = 0;
+    for (bits_t left = bits; left; left &= left - 1, ++n) {
+      REQUIRE(nth_set_bit(bits, n) == (left & -left));
+    }
+    REQUIRE(n == bits_set(bits));
+    REQUIRE((byte_prefix_counts(bits) >> (N2 - N)) == n);
+    if (n < N2) {
+      REQUIRE(nth_set_bit(bits, n) == 0);
+    }
+    bits = bits * 0x9E3779B97F4A7C15 + i;
+  }
+  REQUIRE(nth_set_bit(~0ull, N2 - 1) == set(0, N2 - 1));
+  REQUIRE(nth_set_bit(0, 0) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Sweeping the random word evenly must pick every set bit equally often,
+// regardless of the gaps between them:
+TEST_CASE( "random_set_bit is uniform", "[bits]" ) {
+  const bits_t bits = set(set(set(set(set(0, 0), 1), 2), 40), 63);
+  const unsigned draws = 5000;
+  unsigned counts[N2] = { 0 };
+
+  for (uint64_t d = 0; d < draws; ++d) {
+    const bits_t bit = random_set_bit(bits, (((d << 32) + draws - 1) / draws) << 32);
+    REQUIRE(bits_set(bit) == 1);
+    REQUIRE((bit & bits));
+    counts[pos2bit(bit)]++;
+  }
+  for (idx_t i = 0; i < N2; ++i) {
+    REQUIRE(counts[i] == (test(bits, i)? draws / 5 : 0));
+  }
+  REQUIRE(random_set_bit(0, 12345) == 0);
+}
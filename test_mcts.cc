@@ -9,10 +9,18 @@
 #include "mcts_node.hh"
 #include "mcts_player.hh"
 #include "moves.hh"
+#include "playouts.hh"
+#include "random_player.hh"
 #include "stop.hh"
 
 #include "catch.hh"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <thread>
+
 using namespace Othello;
 
 auto b_odds = [](auto node) { return node.win_odds(Color::DARK); };
@@ -20,14 +28,14 @@ auto w_odds = [](auto node) { return node.win_odds(Color::LIGHT); };
 
 ////////////////////////////////////////////////////////////////////////////////
 TEST_CASE( "Odds at initial node are zero", "[MCTS]" ) {
-  auto node = MCTSNode(Board(0, 0), Color::DARK);
+  auto node = MCTSNode();
   REQUIRE(b_odds(node) == 0.);
   REQUIRE(w_odds(node) == 0.);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 TEST_CASE( "Odds after win are nonzero", "[MCTS]" ) {
-  auto node = MCTSNode(Board(0, 0), Color::DARK);
+  auto node = MCTSNode();
   node.count_wins(1, 0);
   REQUIRE(w_odds(node) == 0.);
   REQUIRE(b_odds(node) > 0.);
@@ -35,33 +43,919 @@ TEST_CASE( "Odds after win are nonzero", "[MCTS]" ) {
 
 ////////////////////////////////////////////////////////////////////////////////
 TEST_CASE( "Odds at start are equal", "[MCTS]" ) {
-  const Board board({ "", "", "", "...ox", "...xo" });
-  auto node = MCTSNode(board, Color::DARK);
+  auto node = MCTSNode();
   REQUIRE(b_odds(node) == Approx(w_odds(node)).epsilon(0.00001));
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Nodes are compact", "[MCTS]" ) {
+  REQUIRE(sizeof(MCTSNode) == 40);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Count the children of a node, and check their parent links:
+static unsigned
+count_children(const MCTSTree& tree, node_idx_t idx)
+{
+  unsigned n = 0;
+  for (auto child = tree[idx].first_child(); child != NO_NODE; child = tree[child].next_sibling()) {
+    REQUIRE(tree[child].parent() == idx);
+    n++;
+  }
+  return n;
+}
+
+// Add a child to a node with board and turn to move, and drop its board:
+static node_idx_t
+add_child(MCTSTree& tree, node_idx_t idx, Board board, Color turn)
+{
+  return tree.add_child(idx, board, turn);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Expansion adds a child per legal move, one at a time", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  const auto legal = all_legal_moves(board, Color::DARK);
+  MCTSTree tree(100);
+  tree.reset(board, Color::DARK);
+  const auto root = tree.root();
+  REQUIRE(tree.expand(root, board, Color::DARK));
+  REQUIRE(!tree.expand(root, board, Color::DARK));
+  REQUIRE(tree[root].expanded());
+  REQUIRE(!tree[root].terminal());
+  REQUIRE(tree[root].untried() == legal);
+  REQUIRE(tree.size() == 1);
+
+  bits_t moves = 0;
+  for (unsigned i = 1; i <= 4; ++i) {
+    auto next = board;
+    const auto child = tree.add_child(root, next, Color::DARK);
+    REQUIRE(child != NO_NODE);
+    REQUIRE(next == effect_move(board, Color::DARK, tree[child].original_move()));
+    REQUIRE(tree[root].first_child() == child);
+    REQUIRE(!tree[child].expanded());
+    REQUIRE(!(moves & tree[child].original_move()));
+    moves |= tree[child].original_move();
+    REQUIRE(tree[root].untried() == (legal & ~moves));
+    REQUIRE(count_children(tree, root) == i);
+  }
+  REQUIRE(add_child(tree, root, board, Color::DARK) == NO_NODE);
+  REQUIRE(moves == legal);
+  REQUIRE(tree.size() == 5);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Expansion passes or stops when there are no moves", "[MCTS]" ) {
+  MCTSTree tree(10);
+  const Board pass({ "xo." });
+  tree.reset(pass, Color::LIGHT);
+  REQUIRE(tree.expand(tree.root(), pass, Color::LIGHT));
+  REQUIRE(count_children(tree, tree.root()) == 1);
+  REQUIRE(tree[tree[tree.root()].first_child()].is_pass());
+  REQUIRE(tree.find_child(tree.root(), 0) == tree.root() + 1);
+  REQUIRE(add_child(tree, tree.root(), pass, Color::LIGHT) == NO_NODE);
+  REQUIRE(!tree[tree.root()].terminal());
+  REQUIRE(!tree[tree.root()].proven());
+
+  const Board over({ "xxx" });
+  tree.reset(over, Color::DARK);
+  REQUIRE(tree.expand(tree.root(), over, Color::DARK));
+  REQUIRE(tree[tree.root()].terminal());
+  REQUIRE(tree[tree.root()].proof() == Proof::DARK_WINS);
+  REQUIRE(tree.size() == 1);
+
+  const Board draw({ "x.o" });
+  tree.reset(draw, Color::LIGHT);
+  REQUIRE(tree.expand(tree.root(), draw, Color::LIGHT));
+  REQUIRE(tree[tree.root()].proof() == Proof::DRAW);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Children aren't added when the arena is full", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  MCTSTree tree(2);
+  tree.reset(board, Color::DARK);
+  REQUIRE(tree.expand(tree.root(), board, Color::DARK));
+  REQUIRE(add_child(tree, tree.root(), board, Color::DARK) != NO_NODE);
+  const auto untried = tree[tree.root()].untried();
+  REQUIRE(add_child(tree, tree.root(), board, Color::DARK) == NO_NODE);
+  REQUIRE(tree[tree.root()].untried() == untried);
+  REQUIRE(tree.size() == 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Selection tries every child, then favors the winning one", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  MCTSTree tree(100);
+  tree.reset(board, Color::DARK);
+  const auto root = tree.root();
+  tree.expand(root, board, Color::DARK);
+  while (add_child(tree, root, board, Color::DARK) != NO_NODE) {
+  }
+
+  std::vector<node_idx_t> seen;
+  for (int i = 0; i < 4; ++i) {
+    tree[root].add_visit();
+    auto child = tree.select_child(root, Color::DARK, 0.5);
+    REQUIRE(std::find(seen.begin(), seen.end(), child) == seen.end());
+    seen.push_back(child);
+    tree[child].add_visit();
+    tree.count_wins(child, i == 2, i != 2);
+  }
+
+  for (int i = 0; i < 20; ++i) {
+    tree[root].add_visit();
+    auto child = tree.select_child(root, Color::DARK, 0.5);
+    REQUIRE(child == seen[2]);
+    tree[child].add_visit();
+    tree[child].mark_win(Color::DARK);
+  }
+  REQUIRE(tree.most_visited_child(root) == seen[2]);
+  REQUIRE(tree[root].visits() == 24);
+  REQUIRE(b_odds(tree[root]) == 1. / 4);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "AMAF counts moves played later by the same player", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  REQUIRE(!MCTSTree(100).has_amaf());
+  MCTSTree tree(100, 0, false, true);
+  tree.reset(board, Color::DARK);
+  const auto root = tree.root();
+  tree.expand(root, board, Color::DARK);
+  while (add_child(tree, root, board, Color::DARK) != NO_NODE) {
+  }
+  const auto child = tree[root].first_child(), other = tree[child].next_sibling();
+  auto next = board;
+  next = effect_move(next, Color::DARK, tree[child].original_move());
+  tree.expand(child, next, Color::LIGHT);
+  const auto gc = add_child(tree, child, next, Color::LIGHT);
+
+  // A playout from gc in which dark then plays other's move, and wins:
+  tree.count_amaf(gc, Color::DARK, tree[other].original_move(), 0, true, false);
+  REQUIRE(tree.amaf_visits(gc) == 1);
+  REQUIRE(tree.amaf_rate(gc) == 0.);
+  REQUIRE(tree.amaf_visits(child) == 1);
+  REQUIRE(tree.amaf_rate(child) == 1.);
+  REQUIRE(tree.amaf_visits(other) == 1);
+  REQUIRE(tree.amaf_rate(other) == 1.);
+  unsigned amaf = 0;
+  for (auto c = tree[root].first_child(); c != NO_NODE; c = tree[c].next_sibling()) {
+    amaf += tree.amaf_visits(c);
+  }
+  REQUIRE(amaf == 2);
+
+  // With equal win rates, RAVE favors the move that did well elsewhere:
+  for (auto c = tree[root].first_child(); c != NO_NODE; c = tree[c].next_sibling()) {
+    tree.add_visit(root);
+    tree.add_visit(c);
+  }
+  tree.count_amaf(root, Color::DARK, tree[child].original_move(), 0, false, true);
+  REQUIRE(tree.amaf_rate(child) == 0.5);
+  REQUIRE(tree.select_child(root, Color::DARK, 0.5) == child);
+  REQUIRE(tree.select_child(root, Color::DARK, 0.5, 1000) == other);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Scores blend the outcome with the tile margin", "[MCTS]" ) {
+  constexpr auto UNIT = MCTSScore::SCORE_UNIT;
+  REQUIRE(MCTSScore::dark_score(2, 0) == UNIT);
+  REQUIRE(MCTSScore::dark_score(0, 0) == UNIT / 2);
+  REQUIRE(MCTSScore::dark_score(-64, 0.5) == 0);
+  REQUIRE(MCTSScore::dark_score(64, 0.5) == UNIT);
+  REQUIRE(MCTSScore::dark_score(32, 0.5) == 7 * UNIT / 8);
+  REQUIRE(MCTSScore::dark_score(Proof::LIGHT_WINS) == 0);
+  REQUIRE(MCTSScore::dark_score(Proof::DRAW) == UNIT / 2);
+
+  MCTSScore score;
+  REQUIRE(score.variance() == 0.25);
+  score.add(UNIT);
+  score.add(0);
+  REQUIRE(score.mean(Color::DARK, 2) == 0.5);
+  REQUIRE(score.mean(Color::LIGHT, 4) == 0.25);  // With two playouts in progress
+  REQUIRE(score.variance() == 0.25);
+  score.add(UNIT / 2);
+  score.add(UNIT / 2);
+  REQUIRE(score.variance() == 0.125);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Two moves that win equally often, but one by far more tiles:
+TEST_CASE( "Selection by scores favors the larger margin", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  MCTSTree tree(100, 0, true);
+  tree.reset(board, Color::DARK);
+  const auto root = tree.root();
+  tree.expand(root, board, Color::DARK);
+  while (add_child(tree, root, board, Color::DARK) != NO_NODE) {
+  }
+  const auto big = tree[root].first_child(), small = tree[big].next_sibling();
+
+  for (auto child = tree[root].first_child(); child != NO_NODE; child = tree[child].next_sibling()) {
+    for (int i = 0; i < 10; ++i) {
+      const int diff = (i % 2)? -2 : (child == big)? 40 : (child == small)? 2 : -40;
+      tree.add_visit(root);
+      tree.add_visit(child);
+      tree.count_wins(child, diff > 0, diff < 0);
+      tree.count_score(child, MCTSScore::dark_score(diff, 0.5));
+    }
+  }
+  REQUIRE(tree[big].visits() == tree[small].visits());
+  REQUIRE(tree.score(big).mean(Color::DARK, 10) > tree.score(small).mean(Color::DARK, 10));
+  REQUIRE(tree.score(root).mean(Color::LIGHT, 40) ==
+          Approx(1 - tree.score(root).mean(Color::DARK, 40)));
+  REQUIRE(tree.select_child(root, Color::DARK, 0.5) == big);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Threads expand and update the same nodes at once, without losing counts
+// or children:
+TEST_CASE( "Concurrent selection and expansion keep counts exact", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  MCTSTree tree(100);
+  tree.reset(board, Color::DARK);
+  const auto root = tree.root();
+  tree.expand(root, board, Color::DARK);
+  constexpr unsigned THREADS = 4, ITERS = 5000;
+  std::atomic<unsigned> expansions = 0;
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < THREADS; ++t) {
+    threads.emplace_back([&]() {
+      for (unsigned i = 0; i < ITERS; ++i) {
+        tree[root].add_visit();
+        auto child = add_child(tree, root, board, Color::DARK);
+        if (child == NO_NODE) {
+          child = tree.select_child(root, Color::DARK, 0.5);
+        }
+        tree[child].add_visit();
+        const auto child_board = effect_move(board, Color::DARK, tree[child].original_move());
+        if (!tree[child].expanded() && tree.expand(child, child_board, Color::LIGHT)) {
+          expansions++;
+        }
+        if (tree[child].expanded()) {
+          add_child(tree, child, child_board, Color::LIGHT);
+        }
+        tree.count_wins(child, 0, 1);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  REQUIRE(expansions == 4);
+  REQUIRE(tree.size() == 1 + 4 + 4 * 3);
+  REQUIRE(tree[root].visits() == THREADS * ITERS);
+  REQUIRE(w_odds(tree[root]) == THREADS * ITERS);
+  REQUIRE(count_children(tree, root) == 4);
+  unsigned visits = 0;
+  for (auto child = tree[root].first_child(); child != NO_NODE; child = tree[child].next_sibling()) {
+    REQUIRE(count_children(tree, child) == 3);
+    visits += tree[child].visits();
+  }
+  REQUIRE(visits == tree[root].visits());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "A subtree keeps its statistics as a new root", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  MCTSTree tree(100);
+  tree.reset(board, Color::DARK);
+  tree.expand(tree.root(), board, Color::DARK);
+
+  // Two children, with two grandchildren under the second, and one
+  // great-grandchild under its last grandchild:
+  const auto first = add_child(tree, tree.root(), board, Color::DARK);
+  const auto second = add_child(tree, tree.root(), board, Color::DARK);
+  const auto pos = tree[second].original_move();
+  const auto next = effect_move(board, Color::DARK, pos);
+  const auto first_board = effect_move(board, Color::DARK, tree[first].original_move());
+  tree.expand(first, first_board, Color::LIGHT);
+  add_child(tree, first, first_board, Color::LIGHT);
+  tree.expand(second, next, Color::LIGHT);
+  add_child(tree, second, next, Color::LIGHT);
+  auto gc_idx = add_child(tree, second, next, Color::LIGHT);
+  REQUIRE(tree.find_child(tree.root(), pos) == second);
+  REQUIRE(tree.find_child(tree.root(), 1) == NO_NODE);
+  const auto reply = tree[gc_idx].original_move();
+  REQUIRE(tree.find_child(second, reply) == gc_idx);
+  const auto gc_board = effect_move(next, Color::LIGHT, reply);
+  tree.expand(gc_idx, gc_board, Color::DARK);
+  add_child(tree, gc_idx, gc_board, Color::DARK);
+  tree.count_wins(gc_idx, 3, 2);
+  tree.count_wins(first, 0, 7);
+  REQUIRE(tree.size() == 1 + 2 + 1 + 2 + 1);
+
+  tree.advance_root(second);
+  REQUIRE(tree.root() == 0);
+  REQUIRE(tree.root_board() == next);
+  REQUIRE(tree.root_turn() == Color::LIGHT);
+  REQUIRE(tree.size() == 1 + 2 + 1);
+  REQUIRE(tree[0].next_sibling() == NO_NODE);
+  REQUIRE(count_children(tree, 0) == 2);
+  REQUIRE(b_odds(tree[0]) == 1.);
+  REQUIRE(w_odds(tree[0]) == 0.5);
+  gc_idx = tree.find_child(0, reply);
+  REQUIRE(b_odds(tree[gc_idx]) == 1.);
+  REQUIRE(count_children(tree, gc_idx) == 1);
+  REQUIRE(tree[gc_idx].untried() != 0);
+
+  tree.advance_root(gc_idx);
+  REQUIRE(tree.root_board() == effect_move(next, Color::LIGHT, reply));
+  REQUIRE(tree.root_turn() == Color::DARK);
+  REQUIRE(tree[0].parent() == NO_NODE);
+  REQUIRE(tree.size() == 2);
+  REQUIRE(count_children(tree, 0) == 1);
+  REQUIRE(b_odds(tree[0]) == 1.);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Pruning keeps the most visited nodes", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  MCTSTree tree(100);
+  tree.reset(board, Color::DARK);
+  const auto root = tree.root();
+  tree.expand(root, board, Color::DARK);
+
+  // Children with 10, 5, 1 and 0 visits, and two grandchildren (3 and 2
+  // visits) under the first one:
+  const unsigned visits[] = { 10, 5, 1, 0 };
+  node_idx_t kids[4];
+  for (unsigned i = 0; i < 4; ++i) {
+    kids[i] = add_child(tree, root, board, Color::DARK);
+    for (unsigned v = 0; v < visits[i]; ++v) {
+      tree[root].add_visit();
+      tree[kids[i]].add_visit();
+    }
+  }
+  const auto first = tree[kids[0]].original_move(), second = tree[kids[1]].original_move();
+  const auto next = effect_move(board, Color::DARK, first);
+  tree.expand(kids[0], next, Color::LIGHT);
+  for (unsigned v : { 3, 2 }) {
+    const auto gc = add_child(tree, kids[0], next, Color::LIGHT);
+    while (v--) {
+      tree[gc].add_visit();
+    }
+  }
+  tree.count_wins(kids[1], 4, 1);
+  REQUIRE(tree.size() == 7);
+
+  REQUIRE(tree.prune(100) == 0);
+  REQUIRE(tree.prune(4) == 4);
+  REQUIRE(tree.size() == 3);
+  REQUIRE(tree.root() == 0);
+  REQUIRE(tree.root_board() == board);
+  REQUIRE(tree[0].visits() == 16);
+  REQUIRE(count_children(tree, 0) == 2);
+  REQUIRE(tree[0].untried() == (all_legal_moves(board, Color::DARK) & ~first & ~second));
+  const auto kept = tree.find_child(0, first);
+  REQUIRE(tree[kept].visits() == 10);
+  REQUIRE(tree[kept].first_child() == NO_NODE);
+  REQUIRE(tree[kept].untried() == all_legal_moves(next, Color::LIGHT));
+  REQUIRE(tree[tree.find_child(0, second)].visits() == 5);
+  REQUIRE(b_odds(tree[0]) == 2.);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Add all the nodes down to a given depth under a node with board and turn to
+// move (checking their hashes), and list them by hash:
+static void
+grow(MCTSTree& tree, node_idx_t idx, Board board, Color turn, unsigned depth,
+     std::map<uint64_t, std::vector<node_idx_t>>& nodes)
+{
+  REQUIRE(tree.hash(idx) == zobrist_hash(board, turn));
+  nodes[tree.hash(idx)].push_back(idx);
+  if (!depth || !tree.expand(idx, board, turn)) {
+    return;
+  }
+  for (auto next = board; ; next = board) {
+    const auto child = tree.add_child(idx, next, turn);
+    if (child == NO_NODE) {
+      break;
+    }
+    grow(tree, child, next, opponent_of(turn), depth - 1, nodes);
+  }
+}
+
+// Check that every position's visits sum those of its nodes:
+static void
+check_positions(const MCTSTree& tree)
+{
+  std::map<uint64_t, unsigned> visits;
+  for (node_idx_t i = 0; i < tree.size(); ++i) {
+    visits[tree.hash(i)] += tree[i].visits();
+  }
+  for (node_idx_t i = 0; i < tree.size(); ++i) {
+    REQUIRE(tree.stats(i).visits() == visits[tree.hash(i)]);
+  }
+}
+
+TEST_CASE( "Transpositions share their position's statistics", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  MCTSTree tree(1000, 1000);
+  tree.reset(board, Color::DARK);
+  std::map<uint64_t, std::vector<node_idx_t>> nodes;
+  grow(tree, tree.root(), board, Color::DARK, 4, nodes);
+
+  // Find two move orders that reach the same position:
+  const auto found = std::find_if(nodes.begin(), nodes.end(),
+                                  [](const auto& kv) { return kv.second.size() > 1; });
+  REQUIRE(found != nodes.end());
+  const auto a = found->second[0], b = found->second[1];
+  REQUIRE(tree[a].parent() != tree[b].parent());
+  REQUIRE(tree[a].transposed());
+  REQUIRE(tree[b].transposed());
+  REQUIRE(!tree[tree.root()].transposed());
+
+  tree.add_visit(a);
+  tree.count_wins(a, 1, 0);
+  REQUIRE(tree[a].visits() == 1);
+  REQUIRE(tree[b].visits() == 0);
+  REQUIRE(tree.stats(b).visits() == 1);
+  REQUIRE(b_odds(tree.stats(b)) == 1.);
+  REQUIRE(b_odds(tree[b]) == 0.);
+  tree.add_visit(b);
+  REQUIRE(tree.stats(a).visits() == 2);
+  check_positions(tree);
+
+  // Re-rooting rebuilds the statistics from the remaining nodes:
+  auto top = a;
+  while (tree[top].parent() != tree.root()) {
+    top = tree[top].parent();
+  }
+  tree.advance_root(top);
+  check_positions(tree);
+
+  // A new tree starts with no statistics:
+  tree.add_visit(tree.root());
+  const auto root_board = tree.root_board();
+  tree.reset(root_board, tree.root_turn());
+  REQUIRE(tree.stats(tree.root()).visits() == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The exact outcome of a position with best play from both sides:
+static Proof
+minimax(Board board, Color turn)
+{
+  auto moves = all_legal_moves(board, turn);
+  if (!moves) {
+    if (all_legal_moves(board, opponent_of(turn))) {
+      return minimax(board, opponent_of(turn));
+    }
+    const int diff = int(bits_set(board.dark())) - int(bits_set(board.light()));
+    return (diff > 0)? Proof::DARK_WINS : (diff < 0)? Proof::LIGHT_WINS : Proof::DRAW;
+  }
+  auto best = win_for(opponent_of(turn));
+  for (; moves && best != win_for(turn); moves &= moves - 1) {
+    const auto proof = minimax(effect_move(board, turn, moves & -moves), opponent_of(turn));
+    if (proof == win_for(turn) || proof == Proof::DRAW) {
+      best = proof;
+    }
+  }
+  return best;
+}
+
+// A random position with a given number of empty squares:
+static Board
+endgame(unsigned empty, uint64_t seed)
+{
+  Xoshiro256 rng(seed);
+  Board board({ "", "", "", "...ox", "...xo" });
+  for (auto turn = Color::DARK; board.moves_left() > empty; turn = opponent_of(turn)) {
+    auto moves = all_legal_moves(board, turn);
+    if (!moves) {
+      REQUIRE(all_legal_moves(board, opponent_of(turn)));
+      continue;
+    }
+    for (auto i = random_below(rng(), bits_set(moves)); i; --i) {
+      moves &= moves - 1;
+    }
+    board = effect_move(board, turn, moves & -moves);
+  }
+  return board;
+}
+
+// Add the whole game tree under a node with board and turn to move,
+// propagating the proof of every terminal node, then check that the node is
+// proven right, and that selection avoids its proven losses:
+static void
+solve(MCTSTree& tree, node_idx_t idx, Board board, Color turn)
+{
+  REQUIRE(tree.expand(idx, board, turn));
+  if (tree[idx].terminal()) {
+    tree.propagate_proof(idx, turn);
+  } else if (const auto pass = tree.find_child(idx, 0); pass != NO_NODE) {
+    solve(tree, pass, board, opponent_of(turn));
+  }
+  for (auto next = board; ; next = board) {
+    const auto child = tree.add_child(idx, next, turn);
+    if (child == NO_NODE) {
+      break;
+    }
+    solve(tree, child, next, opponent_of(turn));
+  }
+
+  const auto proof = minimax(board, turn);
+  REQUIRE(tree[idx].proof() == proof);
+  if (!tree[idx].terminal() && proof != win_for(opponent_of(turn))) {
+    const auto best = tree.select_child(idx, turn, 0.5);
+    REQUIRE(tree[best].proof() != win_for(opponent_of(turn)));
+  }
+}
+
+TEST_CASE( "Proofs propagate up to the root", "[MCTS]" ) {
+  MCTSTree tree(1 << 20);
+  for (uint64_t seed = 1; seed <= 10; ++seed) {
+    const auto board = endgame(7, seed);
+    tree.reset(board, Color::DARK);
+    solve(tree, tree.root(), board, Color::DARK);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A stop condition with a budget of max_moves checks, which counts them all:
+struct CountingStop : StopByMoves {
+  std::atomic<uint64_t> calls_ = 0;
+  CountingStop(uint64_t max_moves) : StopByMoves(max_moves) {}
+  bool operator()() override { ++calls_; return StopByMoves::operator()(); }
+};
+
+// A search stops once it proves its root, long before its budget runs out:
+TEST_CASE( "MCTS players stop searching proven endgames", "[MCTS]" ) {
+  for (uint64_t seed = 1; seed <= 5; ++seed) {
+    const auto board = endgame(8, seed);
+    const auto turn = (seed % 2)? Color::DARK : Color::LIGHT;
+    const auto moves = all_legal_moves(board, turn);
+    if (!moves) {
+      continue;
+    }
+    auto stopper = std::make_shared<CountingStop>(100'000'000);
+    const MCTSPlayer player(turn, stopper, MCTSConfig(), seed);
+    const auto move = player.get_move(board, moves);
+    REQUIRE(stopper->calls_ < 1'000'000);
+    REQUIRE(minimax(effect_move(board, turn, move), opponent_of(turn)) == minimax(board, turn));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Threads reserve checks in chunks, but never go on for more checks in all
+// than the budget allows, search after search:
+TEST_CASE( "StopByMoves counts checks exactly across threads", "[MCTS]" ) {
+  for (uint64_t budget : { 1, 2, 100, 12345, 1000000 }) {
+    StopByMoves stop(budget);
+    for (int search = 0; search < 3; ++search) {
+      stop.reset();
+      std::atomic<uint64_t> went_on = 0;
+      std::atomic<bool> stayed_stopped = true;
+      std::vector<std::thread> threads;
+      for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&]() {
+          uint64_t mine = 0;
+          while (!stop()) {
+            ++mine;
+          }
+          stayed_stopped = stayed_stopped && stop();
+          went_on += mine;
+        });
+      }
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      REQUIRE(stayed_stopped);
+      REQUIRE(went_on == std::max<uint64_t>(budget, 1) - 1);
+      REQUIRE(stop.reserved() == went_on);
+    }
+  }
+
+  // A thread's leftover reservation doesn't carry over to a new search:
+  StopByMoves stop(1000000);
+  REQUIRE(!stop());
+  stop.reset();
+  REQUIRE(stop.reserved() == 0);
+  REQUIRE(!stop());
+  REQUIRE(stop.reserved() > 0);
+}
+
+// A thread that checks several instances in turn keeps each one's count exact:
+TEST_CASE( "StopByMoves counts checks exactly across interleaved instances", "[MCTS]" ) {
+  std::vector<std::unique_ptr<StopByMoves>> stops;
+  for (unsigned i = 0; i < StopByMoves::MAX_INSTANCES; ++i) {
+    stops.push_back(std::make_unique<StopByMoves>(10000 + 37 * i));
+  }
+  for (int search = 0; search < 2; ++search) {
+    std::vector<std::atomic<uint64_t>> went_on(stops.size());
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; ++t) {
+      threads.emplace_back([&]() {
+        for (bool going = true; going; ) {
+          going = false;
+          for (unsigned i = 0; i < stops.size(); ++i) {
+            if (!(*stops[i])()) {
+              ++went_on[i];
+              going = true;
+            }
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    for (unsigned i = 0; i < stops.size(); ++i) {
+      REQUIRE(went_on[i] == stops[i]->budget() - 1);
+      stops[i]->reset();
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Root statistics of moves with the given visits and win rates:
+static RootStats
+root_stats(unsigned nmoves, std::initializer_list<std::pair<uint32_t, double>> children)
+{
+  RootStats stats;
+  stats.nmoves_ = nmoves;
+  for (auto [ visits, rate ] : children) {
+    stats.squares_[stats.nchildren_] = stats.nchildren_;
+    stats.visits_[stats.nchildren_] = visits;
+    stats.win_rates_[stats.nchildren_++] = rate;
+  }
+  return stats;
+}
+
+TEST_CASE( "Confident searches stop before their budget runs out", "[MCTS]" ) {
+  StopByConfidence stop(std::make_shared<StopByMoves>(10000), 3, 1000);
+  REQUIRE(stop.observes());
+  REQUIRE(stop.budget() == 10000);
+
+  // A forced move:
+  stop.reset();
+  stop.observe(root_stats(1, {}));
+  REQUIRE(stop());
+
+  // Close moves, and an untried one, don't stop it:
+  stop.reset();
+  stop.observe(root_stats(3, { { 3000, 0.6 }, { 2500, 0.58 } }));
+  REQUIRE(!stop());
+  stop.observe(root_stats(3, { { 3000, 0.9 }, { 2000, 0.4 } }));
+  REQUIRE(!stop());
+
+  // A leader that's far ahead, or that can't be caught in the budget left:
+  stop.observe(root_stats(2, { { 3000, 0.9 }, { 2000, 0.4 } }));
+  REQUIRE(stop());
+  stop.reset();
+  for (int i = 0; i < 9000; ++i) {
+    REQUIRE(!stop());
+  }
+  REQUIRE(stop.used() >= 9000);
+  stop.observe(root_stats(3, { { 5000, 0.6 }, { 3900, 0.58 } }));
+  REQUIRE(stop());
+
+  // Whichever decides it, the other condition still stops it:
+  stop.reset();
+  for (int i = 1; i < 10000; ++i) {
+    REQUIRE(!stop());
+  }
+  REQUIRE(stop());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "A game clock spends most of its time in the mid-game", "[MCTS]" ) {
+  using namespace std::chrono_literals;
+  REQUIRE(StopByClock::phase_weight(30) == 1.);
+  REQUIRE(StopByClock::phase_weight(58) < StopByClock::phase_weight(50));
+  REQUIRE(StopByClock::phase_weight(50) < 1.);
+  REQUIRE(StopByClock::phase_weight(4) < StopByClock::phase_weight(10));
+
+  // The first move gets less than an even split of the clock between the
+  // player's 30 moves, and no move can use up the clock (if no time is used,
+  // every move gets a share of the whole clock):
+  StopByClock stop(StopByClock::duration_t(10000));
+  stop.start_move(60, 8);
+  REQUIRE(stop.soft_limit() < 10000ms / 30);
+  for (unsigned left = 58; left > 0; left -= 2) {
+    stop.start_move(left, 8);
+    REQUIRE(stop.remaining() == 10000ms);
+    REQUIRE(stop.soft_limit() <= stop.hard_limit());
+    REQUIRE(stop.hard_limit() <= StopByClock::Clock::duration(10000ms) / 3);
+  }
+
+  // A forced move takes no time, and a new game starts with a full clock:
+  stop.start_move(20, 1);
+  REQUIRE(stop.hard_limit() == 0ms);
+  REQUIRE(stop());
+  stop.start_move(60, 4);
+  REQUIRE(stop.remaining() == 10000ms);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The time until a move is finished is charged to the clock, and a move that
+// keeps changing its mind gets more time:
+TEST_CASE( "A game clock charges each move's time, plus increments", "[MCTS]" ) {
+  using namespace std::chrono_literals;
+  StopByClock stop(StopByClock::duration_t(1000), StopByClock::duration_t(100));
+  stop.start_move(30, 10);
+  const auto soft = stop.soft_limit();
+  REQUIRE(soft > 50ms);
+  while (!stop()) {
+  }
+  std::this_thread::sleep_for(20ms);  // The player's work after the search
+  stop.finish_move();
+  const auto start = StopByClock::Clock::now();
+  stop.start_move(28, 10);
+  REQUIRE(stop.remaining() <= 1080ms - soft);
+  REQUIRE(stop.remaining() > 1030ms - soft);
+
+  const auto leader_at = [](unsigned square) {
+    auto stats = root_stats(2, { { 10, 0.5 }, { 10, 0.5 } });
+    stats.visits_[square]++;
+    return stats;
+  };
+  unsigned leader = 0;
+  do {
+    stop.observe(leader_at(leader ^= 1));
+  } while (!stop());
+  REQUIRE(StopByClock::Clock::now() - start >= stop.hard_limit());
+  REQUIRE(stop.hard_limit() > stop.soft_limit());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A forced move takes no playouts at all (but the first check of every
+// search thread):
+TEST_CASE( "Confident MCTS players play forced moves at once", "[MCTS]" ) {
+  const Board board({ "xo." });
+  const auto moves = all_legal_moves(board, Color::DARK);
+  REQUIRE(bits_set(moves) == 1);
+
+  auto counter = std::make_shared<CountingStop>(100'000);
+  const MCTSPlayer player(Color::DARK, std::make_shared<StopByConfidence>(counter), MCTSConfig(), 1);
+  REQUIRE(player.get_move(board, moves) == moves);
+  REQUIRE(counter->calls_ <= std::max(1u, std::thread::hardware_concurrency()));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A search that outgrows its trees prunes them, and goes on to pick a move:
+TEST_CASE( "MCTS players prune their trees to stay within a memory budget", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  const auto moves = all_legal_moves(board, Color::DARK);
+  auto stopper = std::shared_ptr<StopCondition>(new StopByMoves(20000));
+  const auto option_bytes = MCTSTree::HASH_BYTES + MCTSTree::POSITION_BYTES +
+                            MCTSTree::SCORE_BYTES + MCTSTree::AMAF_BYTES;
+  for (bool options : { false, true }) {  // Also with transpositions, RAVE and scores
+    MCTSConfig config;
+    config.max_memory_ = 1000 * (MCTSTree::NODE_BYTES + option_bytes);
+    config.transpositions_ = options;
+    config.rave_ = options? 30 : 0;
+    config.scores_ = options;
+    const MCTSPlayer dark(Color::DARK, stopper, config, 1);
+    REQUIRE(dark.capacity() > 0);
+    REQUIRE(dark.capacity() * (MCTSTree::NODE_BYTES + (options? option_bytes : 0)) <=
+            config.max_memory_);
+
+    const auto move = dark.get_move(board, moves);
+    REQUIRE(bits_set(move) == 1);
+    REQUIRE((move & moves));
+    REQUIRE(dark.prunes() > 0);
+    REQUIRE(dark.peak_nodes() > 0);
+    REQUIRE(dark.peak_nodes() <= dark.capacity());
+
+    const RandomPlayer rnd(Color::LIGHT, 2);
+    const auto diff = play_game(board, &dark, &rnd);
+    REQUIRE(std::abs(diff) <= int(N2));
+    REQUIRE(dark.peak_nodes() <= dark.capacity());
+  }
+
+  // A search that fits in its trees never prunes them:
+  const MCTSPlayer roomy(Color::DARK, stopper, MCTSConfig(), 1);
+  REQUIRE(bits_set(roomy.get_move(board, moves)) == 1);
+  REQUIRE(roomy.peak_nodes() < roomy.capacity());
+  REQUIRE(roomy.prunes() == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "MCTS players keep their trees through a whole game", "[MCTS]" ) {
+  const Board board({ "", "", "", "...ox", "...xo" });
+  auto stopper = std::shared_ptr<StopCondition>(new StopByMoves(200));
+  const MCTSPlayer dark(Color::DARK, stopper, MCTSConfig(), 1);
+  const MCTSPlayer light(Color::LIGHT, stopper, MCTSConfig(), 2);
+  const RandomPlayer rnd(Color::LIGHT, 3);
+
+  for (auto opponent : std::initializer_list<player_ptr_t>{ &light, &rnd }) {
+    const auto diff = play_game(board, &dark, opponent);
+    REQUIRE(std::abs(diff) <= int(N2));
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // For this starting board: both players win if they pick the top-right corner first
+static const Board WINNING_BOARD({
+    "oxxxxxx.",
+    "oxxxxxxo",
+    "xxxxxxxx",
+    "xxxxxxxx",
+    "oooxoooo",
+    "ooxooooo",
+    "ooooooxo",
+    "xoooooo.",
+    });
+static constexpr bits_t WINNING_MOVE =
+    0b00000000'00000000'00000000'00000000'00000000'00000000'00000000'10000000;
+
 TEST_CASE( "Picks an always-winning move over an always-losing move", "[MCTS]" ) {
-  const Board board({
-      "oxxxxxx.",
-      "oxxxxxxo",
-      "xxxxxxxx",
-      "xxxxxxxx",
-      "oooxoooo",
-      "ooxooooo",
-      "ooooooxo",
-      "xoooooo.",
-      });
+  const auto& board = WINNING_BOARD;
   auto stopper = std::shared_ptr<StopCondition>(new StopByMoves);
 
   MCTSPlayer pb(Color::DARK, stopper);
   auto moves = all_legal_moves(board, Color::DARK);
-  REQUIRE(pb.get_move(board, moves) ==
-      0b00000000'00000000'00000000'00000000'00000000'00000000'00000000'10000000);
+  REQUIRE(pb.get_move(board, moves) == WINNING_MOVE);
 
   MCTSPlayer pw(Color::LIGHT, stopper);
   moves = all_legal_moves(board, Color::LIGHT);
-  REQUIRE(pb.get_move(board, moves) ==
-      0b00000000'00000000'00000000'00000000'00000000'00000000'00000000'10000000);
+  REQUIRE(pb.get_move(board, moves) == WINNING_MOVE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same board as above, with a private tree per thread:
+TEST_CASE( "Root parallelism picks the always-winning move", "[MCTS]" ) {
+  const auto& board = WINNING_BOARD;
+  auto stopper = std::shared_ptr<StopCondition>(new StopByMoves);
+  MCTSConfig config;
+  config.parallel_ = Parallelism::ROOT;
+
+  setenv("NTHREAD", "3", 1);
+  const MCTSPlayer pb(Color::DARK, stopper, config, 1);
+  const MCTSPlayer pw(Color::LIGHT, stopper, config, 2);
+  unsetenv("NTHREAD");
+
+  REQUIRE(pb.get_move(board, all_legal_moves(board, Color::DARK)) == WINNING_MOVE);
+  REQUIRE(pw.get_move(board, all_legal_moves(board, Color::LIGHT)) == WINNING_MOVE);
+  REQUIRE(play_game(board, &pb, &pw) > 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same board as above, with threads sharing the root under every root policy:
+TEST_CASE( "Every root policy picks the always-winning move", "[MCTS]" ) {
+  const auto& board = WINNING_BOARD;
+  auto stopper = std::shared_ptr<StopCondition>(new StopByMoves(4000));
+  REQUIRE(stopper->budget() == 4000);
+
+  setenv("NTHREAD", "3", 1);
+  for (auto policy : { RootPolicy::UCB1, RootPolicy::THOMPSON, RootPolicy::HALVING }) {
+    MCTSConfig config;
+    config.root_ = policy;
+    const MCTSPlayer pb(Color::DARK, stopper, config, 1);
+    REQUIRE(pb.get_move(board, all_legal_moves(board, Color::DARK)) == WINNING_MOVE);
+
+    const Board start({ "", "", "", "...ox", "...xo" });
+    const auto moves = all_legal_moves(start, Color::DARK);
+    const MCTSPlayer opener(Color::DARK, stopper, config, 2);
+    const auto move = opener.get_move(start, moves);
+    REQUIRE(bits_set(move) == 1);
+    REQUIRE((move & moves));
+  }
+  unsetenv("NTHREAD");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Both boards end with three dark tiles, whoever moves first, and dark always
+// plays the third square:
+TEST_CASE( "Playout engine plays every game to the end", "[MCTS]" ) {
+  const Board over({ "xxx" });
+  const Board forced({ "xo." });
+  unsigned tag = 0, games = 0;
+  unsigned per_tag[3] = { 0, 0, 0 };
+
+  PlayoutEngine engine(Xoshiro256(1));
+  engine.run(
+      [&]() {
+        tag = (tag + 1) % 3;
+        return Playout{ tag? forced : over, (tag == 2)? Color::LIGHT : Color::DARK, tag };
+      },
+      [&](unsigned t, int diff, PlayedMoves played) {
+        REQUIRE(t < 3);
+        REQUIRE(diff == 3);
+        REQUIRE(played.dark_ == (t? ONE << 2 : 0));
+        REQUIRE(played.light_ == 0);
+        per_tag[t]++;
+        return ++games < 300;
+      });
+
+  REQUIRE(games == 300);
+  for (auto count : per_tag) {
+    REQUIRE(count > 90);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "RandomPolicy picks the same moves as RandomPlayer", "[MCTS]" ) {
+  const RandomPlayer player(Color::DARK, 12345);
+  RandomPolicy policy(Xoshiro256(12345));
+  bits_t moves = 0x8100'0024'1800'0081;
+
+  for (int i = 0; i < 1000; ++i) {
+    REQUIRE(policy(0, 0, moves) == player.get_move(Board(0, 0), moves));
+    moves = moves * 0x9E3779B97F4A7C15 | 1;
+  }
 }
@@ -8,9 +8,15 @@
 
 #include "board.hh"
 #include "catch.hh"
+#include "kernels.hh"
 #include "moves.hh"
+#include "playouts.hh"
 #include "player.hh"
+#include "random_games.hh"
 #include "scan.hh"
+#include "zobrist.hh"
+
+#include <map>
 
 using namespace Othello;
 using enum Color;
@@ -154,6 +160,80 @@ TEST_CASE( "legal_moves stops at board borders", "[moves]" ) {
   }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "fill_legal_moves matches legal_moves in every direction", "[moves]" ) {
+  const Board b({
+    "..ooxoox",
+    "o.ooox.x",
+    "xoox.ox.",
+    "x.x.xoxo",
+    "ooo.ooxo",
+    ".o.oooox",
+    ".x.ox.ox",
+    "xo.xo.x."
+    });
+
+  for (auto [mine, theirs] : { std::pair(b.dark(), b.light()), std::pair(b.light(), b.dark()) }) {
+    REQUIRE(fill_legal_moves(L2R, mine, theirs) == legal_moves(L_START, L2R, mine, theirs));
+    REQUIRE(fill_legal_moves(R2L, mine, theirs) == legal_moves(R_START, R2L, mine, theirs));
+    REQUIRE(fill_legal_moves(T2B, mine, theirs) == legal_moves(T_START, T2B, mine, theirs));
+    REQUIRE(fill_legal_moves(B2T, mine, theirs) == legal_moves(B_START, B2T, mine, theirs));
+    REQUIRE(fill_legal_moves(BL2TR, mine, theirs) == legal_moves(BL_START, BL2TR, mine, theirs));
+    REQUIRE(fill_legal_moves(BR2TL, mine, theirs) == legal_moves(BR_START, BR2TL, mine, theirs));
+    REQUIRE(fill_legal_moves(TR2BL, mine, theirs) == legal_moves(TR_START, TR2BL, mine, theirs));
+    REQUIRE(fill_legal_moves(TL2BR, mine, theirs) == legal_moves(TL_START, TL2BR, mine, theirs));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Plays a few hundred pseudo-random games and compares all move generators and
+// flip kernels that this CPU supports on every position (and both colors)
+// encountered along the way.
+TEST_CASE( "All kernels agree on random games", "[moves]" ) {
+  Xoshiro256 rng(1), select_rng(2);
+  unsigned positions = 0;
+
+  play_random_games(300, rng, [&](bits_t mine, bits_t theirs, bits_t moves) {
+    REQUIRE(all_legal_moves_fill(mine, theirs) == moves);
+    const auto rnd = select_rng();
+    for (const auto kp : supported_kernels()) {
+      const auto& kernels = *kp;
+      REQUIRE(kernels.legal_moves_(mine, theirs) == moves);
+      REQUIRE(kernels.legal_moves_(theirs, mine) == all_legal_moves_fsm(theirs, mine));
+      for (bits_t left = moves; left; left &= left - 1) {
+        const bits_t pos = left & -left;
+        REQUIRE(kernels.flipped_(mine, theirs, pos) == all_flipped_scan(mine, theirs, pos));
+        REQUIRE(all_flipped_fill(mine, theirs, pos) == all_flipped_scan(mine, theirs, pos));
+      }
+      if (moves) {
+        REQUIRE(kernels.select_move_(moves, rnd) == kernels_for(Isa::SCALAR).select_move_(moves, rnd));
+      }
+    }
+    ++positions;
+  });
+  REQUIRE(positions > 300 * 30);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Line tables cover each position's lines", "[moves]" ) {
+  for (idx_t bit = 0; bit < N2; ++bit) {
+    for (idx_t line = 0; line < NLINES; ++line) {
+      bits_t mask = LINE_MASKS[bit][line];
+      for (idx_t i = 0; i < LINE_INDICES[bit][line]; ++i) {
+        mask &= mask - 1;
+      }
+      REQUIRE(pos2bit(mask) == bit);
+    }
+    REQUIRE(LINE_MASKS[bit][0] == (T_START << (N * bit2row(bit))));
+    REQUIRE(LINE_MASKS[bit][1] == (L_START << bit2col(bit)));
+  }
+
+  REQUIRE(LINE_MASKS[pos2bit(0, 0)][2] == 0x8040201008040201);
+  REQUIRE(LINE_MASKS[pos2bit(0, 0)][3] == setpos(0, 0));
+  REQUIRE(LINE_MASKS[pos2bit(2, 5)][3] == (setpos(0, 7) | setpos(1, 6) | setpos(2, 5) |
+        setpos(3, 4) | setpos(4, 3) | setpos(5, 2) | setpos(6, 1) | setpos(7, 0)));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_CASE( "Inside board computes correctly - R2L", "[moves]" ) {
   Board b_in({  ".x......" });  // b_in.dark() == 2
@@ -386,6 +466,201 @@ TEST_CASE( "effect_moves changes all flipped bits", "[moves]" ) {
     "xxxxo.x."}));
 }
 
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "generate_children matches effect_move for every legal move", "[moves]" ) {
+  Board b({
+    "..ooxoox",
+    "o.ooox.x",
+    "xoox.ox.",
+    "x.x.xoxo",
+    "ooo.ooxo",
+    ".o.oooox",
+    ".x.ox.ox",
+    "xo.xo.x."
+    });
+
+  for (auto color : { DARK, LIGHT }) {
+    const auto moves = all_legal_moves(b, color);
+    const auto children = generate_children(b, color);
+    REQUIRE(children.moves() == moves);
+    REQUIRE(children.size() == bits_set(moves));
+
+    bits_t prev = 0;
+    for (const auto& child : children) {
+      REQUIRE(child.move_ > prev);
+      REQUIRE((child.move_ & moves));
+      REQUIRE(child.board_ == effect_move(b, color, child.move_));
+      REQUIRE(child.flipped_ == ((color == DARK)?
+            all_flipped(b.dark(), b.light(), child.move_) :
+            all_flipped(b.light(), b.dark(), child.move_)));
+      prev = child.move_;
+    }
+  }
+
+  const Board stuck({ "ooo..xxx", "oo....xx", "o......x" });
+  REQUIRE(generate_children(stuck, DARK).empty());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Along random games, the incremental hash always matches the hash computed
+// from scratch, and different positions never collide:
+TEST_CASE( "Zobrist hashes are updated incrementally by effect_move", "[moves]" ) {
+  Xoshiro256 rng(2718);
+  std::map<uint64_t, std::pair<Board, Color>> seen;
+  for (int game = 0; game < 100; ++game) {
+    Board board({ "", "", "", "...ox", "...xo" });
+    Color turn = DARK;
+    uint64_t hash = zobrist_hash(board, turn);
+    for (unsigned passes = 0; passes < 2; turn = opponent_of(turn)) {
+      REQUIRE(hash == zobrist_hash(board, turn));
+      const auto [it, added] = seen.try_emplace(hash, board, turn);
+      REQUIRE((added || it->second == std::make_pair(board, turn)));
+
+      bits_t moves = all_legal_moves(board, turn);
+      if (!moves) {
+        passes++;
+        hash = zobrist_pass(hash);
+        continue;
+      }
+      passes = 0;
+      for (auto skip = rng() % bits_set(moves); skip; --skip) {
+        moves &= moves - 1;
+      }
+      const bits_t pos = moves & -moves;
+      const auto next = effect_move(board, turn, pos, hash);
+      REQUIRE(next == effect_move(board, turn, pos));
+      board = next;
+    }
+  }
+  REQUIRE(zobrist_hash(Board(), DARK) != zobrist_hash(Board(), LIGHT));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Play a batch of random games in lock step, where finished games keep passing.
+// An odd batch size also exercises the tails of the vectorized loops.
+TEST_CASE( "Batched kernels match the scalar ones on random games", "[moves]" ) {
+  const Board initial(setpos(3, 3) | setpos(4, 4), setpos(3, 4) | setpos(4, 3));
+
+  for (const auto kp : supported_kernels()) {
+    const auto& kernels = *kp;
+    Xoshiro256 rng(1);
+    BoardBatch batch;
+    for (unsigned i = 0; i < 37; ++i) {
+      batch.push_back(initial);
+    }
+    REQUIRE(batch.size() == 37);
+    std::vector<bits_t> moves(batch.size());
+
+    Color color = DARK;
+    for (unsigned turn = 0; turn < 70; ++turn, color = (color == DARK)? LIGHT : DARK) {
+      const BoardBatch before = batch;
+      bits_t* mine = (color == DARK)? batch.dark() : batch.light();
+      bits_t* theirs = (color == DARK)? batch.light() : batch.dark();
+
+      kernels.legal_moves_batch_(mine, theirs, moves.data(), batch.size());
+      for (size_t i = 0; i < batch.size(); ++i) {
+        REQUIRE(moves[i] == all_legal_moves(before[i], color));
+        if (moves[i]) {
+          moves[i] = kernels_for(Isa::SCALAR).select_move_(moves[i], rng());
+        }
+      }
+
+      kernels.effect_move_batch_(mine, theirs, moves.data(), batch.size());
+      for (size_t i = 0; i < batch.size(); ++i) {
+        REQUIRE(batch[i] == (moves[i]? effect_move(before[i], color, moves[i]) : before[i]));
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Every lane either plays one of its legal moves or passes, and all kernels
+// pick the same moves from the same random states.
+TEST_CASE( "Playout ply kernels play legal moves in every lane", "[moves]" ) {
+  PlayoutLanes start;
+  Xoshiro256 rng(12345);
+  start.rng_.seed(rng);
+  for (unsigned i = 0; i < PLAYOUT_LANES; ++i) {
+    start.mine_[i] = setpos(3, 4) | setpos(4, 3);
+    start.theirs_[i] = setpos(3, 3) | setpos(4, 4);
+    start.dark_[i] = 0;
+    start.passes_[i] = 0;
+    start.dark_moves_[i] = 0;
+    start.rnd_[i] = rng();
+  }
+  // Two lanes with no moves for the player to move (but some for the other):
+  start.mine_[5] = start.mine_[6] = 0;
+  start.theirs_[6] = ~0ull;
+
+  for (unsigned ply = 0; ply < 130; ++ply) {
+    PlayoutLanes expected = start;
+    kernels_for(Isa::SCALAR).playout_ply_(expected);
+
+    for (unsigned i = 0; i < PLAYOUT_LANES; ++i) {
+      const auto mine = start.mine_[i], theirs = start.theirs_[i];
+      const auto moves = all_legal_moves_fsm(mine, theirs);
+      REQUIRE(expected.dark_[i] == ~start.dark_[i]);
+      const auto played = expected.dark_moves_[i] ^ start.dark_moves_[i];
+      if (!moves) {
+        REQUIRE(!played);
+        REQUIRE(expected.mine_[i] == theirs);
+        REQUIRE(expected.theirs_[i] == mine);
+        REQUIRE(expected.passes_[i] == start.passes_[i] + 1);
+      } else {
+        const auto pos = expected.theirs_[i] & ~(mine | theirs);
+        REQUIRE(bits_set(pos) == 1);
+        REQUIRE((pos & moves));
+        REQUIRE(expected.mine_[i] == (theirs ^ all_flipped_scan(mine, theirs, pos)));
+        REQUIRE(expected.passes_[i] == 0);
+        REQUIRE(played == (start.dark_[i]? pos : 0));
+      }
+    }
+
+    for (const auto kp : supported_kernels()) {
+      PlayoutLanes lanes = start;
+      kp->playout_ply_(lanes);
+      for (unsigned i = 0; i < PLAYOUT_LANES; ++i) {
+        REQUIRE(lanes.mine_[i] == expected.mine_[i]);
+        REQUIRE(lanes.theirs_[i] == expected.theirs_[i]);
+        REQUIRE(lanes.passes_[i] == expected.passes_[i]);
+        REQUIRE(lanes.dark_moves_[i] == expected.dark_moves_[i]);
+        REQUIRE(lanes.rnd_[i] == expected.rnd_[i]);
+      }
+    }
+    start = expected;
+  }
+  REQUIRE(start.passes_[0] >= 2);  // All games are over by now
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "BoardBatch overloads use the current player's side", "[moves]" ) {
+  const Board b({
+    "........",
+    "........",
+    "...xo...",
+    "...ox...",
+    "...xx...",
+    });
+
+  BoardBatch batch(2);
+  batch.set(0, b);
+  batch.set(1, Board(b.light(), b.dark()));
+
+  for (auto color : { DARK, LIGHT }) {
+    bits_t moves[2];
+    all_legal_moves(batch, color, moves);
+    REQUIRE(moves[0] == all_legal_moves(batch[0], color));
+    REQUIRE(moves[1] == all_legal_moves(batch[1], color));
+
+    BoardBatch after = batch;
+    moves[0] &= -moves[0];
+    moves[1] = 0;
+    effect_move(after, color, moves);
+    REQUIRE(after[0] == effect_move(batch[0], color, moves[0]));
+    REQUIRE(after[1] == batch[1]);
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TEST_CASE( "find_flipped finds nothing when no legal moves", "[moves]" ) {
   SECTION( "horizontal and vertical" ) {
@@ -486,3 +761,38 @@ TEST_CASE( "Computes the correct tile difference", "[moves]" ) {
   REQUIRE(play_game(board, pb, pw) == -2);
   REQUIRE(play_game(board, pw, pb) == -2);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+// Both play the first legal move (lowest bit) on every turn, so the games and
+// their outcomes must be identical:
+TEST_CASE( "playout matches play_game", "[moves]" ) {
+  struct FirstMovePlayer : public Player {
+    FirstMovePlayer(Color color) : Player(color) {}
+    ~FirstMovePlayer() = default;
+    void display_board(Board) const {}
+    bits_t get_move(Board, bits_t moves) const { return moves & -moves; }
+    void notify_move(Board, bits_t) const {}
+    void game_over(Board) const {}
+  };
+  const FirstMovePlayer pb(DARK), pw(LIGHT);
+  auto first_move = [](bits_t, bits_t, bits_t moves) { return moves & -moves; };
+
+  const Board initial(setpos(3, 3) | setpos(4, 4), setpos(3, 4) | setpos(4, 3));
+  const Board midgame({
+    "..ooxoox",
+    "o.ooox.x",
+    "xoox.ox.",
+    "x.x.xoxo",
+    "ooo.ooxo",
+    ".o.oooox",
+    ".x.ox.ox",
+    "xo.xo.x."
+    });
+  const Board over({ "ooo..xxx", "oo....xx", "o......x" });
+
+  for (const auto& board : { initial, midgame, over }) {
+    REQUIRE(playout(board, DARK, first_move) == play_game(board, &pb, &pw));
+    REQUIRE(playout(board, LIGHT, first_move) == play_game(board, &pw, &pb));
+  }
+  REQUIRE(playout(over, DARK, first_move) == 0);
+}
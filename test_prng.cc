@@ -0,0 +1,92 @@
+/*
+ * Unit tests for the pseudo-random number generators
+ */
+
+#define CATCH_CONFIG_MAIN
+
+#include "prng.hh"
+#include "catch.hh"
+
+#include <random>
+#include <set>
+
+using namespace Othello;
+
+////////////////////////////////////////////////////////////////////////////////
+// First outputs of the reference implementation for the state { 1, 2, 3, 4 }:
+TEST_CASE( "Xoshiro256 matches the reference xoshiro256++", "[prng]" ) {
+  Xoshiro256 rng(1, 2, 3, 4);
+  REQUIRE(rng() == 41943041);
+  REQUIRE(rng() == 58720359);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Xoshiro256 drives the standard distributions", "[prng]" ) {
+  static_assert(std::uniform_random_bit_generator<Xoshiro256>);
+  Xoshiro256 rng(5);
+  std::uniform_int_distribution<int> die(1, 6);
+  for (int i = 0; i < 100; ++i) {
+    const auto x = die(rng);
+    REQUIRE((x >= 1 && x <= 6));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Streams are reproducible from a seed", "[prng]" ) {
+  Xoshiro256 a(42), b(42), c(43);
+  for (int i = 0; i < 100; ++i) {
+    const auto x = a();
+    REQUIRE(x == b());
+    REQUIRE(x != c());
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Split streams differ from each other and from the original, and splitting
+// is deterministic:
+TEST_CASE( "Split streams are distinct", "[prng]" ) {
+  Xoshiro256 base(7), again(7);
+  std::set<uint64_t> firsts;
+  for (int s = 0; s < 16; ++s) {
+    auto stream = base.split();
+    auto same = again.split();
+    const auto first = stream();
+    REQUIRE(first == same());
+    firsts.insert(first);
+  }
+  REQUIRE(firsts.size() == 16);
+
+  Xoshiro256 unjumped(7);
+  Xoshiro256 jumped(7);
+  jumped.jump();
+  REQUIRE(unjumped() != jumped());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "Each lane follows its own split stream", "[prng]" ) {
+  constexpr unsigned LANES = 8;
+  Xoshiro256 base(99), reference(99);
+  XoshiroLanes<LANES> lanes;
+  lanes.seed(base);
+
+  Xoshiro256 streams[LANES] = {
+    reference.split(), reference.split(), reference.split(), reference.split(),
+    reference.split(), reference.split(), reference.split(), reference.split() };
+
+  for (int round = 0; round < 50; ++round) {
+    uint64_t out[LANES];
+    lanes.next(out);
+    for (unsigned lane = 0; lane < LANES; ++lane) {
+      REQUIRE(out[lane] == streams[lane]());
+    }
+  }
+  // The base generator moves past all the lanes' streams:
+  REQUIRE(base() == reference());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TEST_CASE( "new_stream hands out different streams", "[prng]" ) {
+  auto a = new_stream();
+  auto b = new_stream();
+  REQUIRE(a() != b());
+}
@@ -0,0 +1,74 @@
+/*
+ * Zobrist hashing of positions (a board and the player to move). Every
+ * (color, square) pair has a random 64-bit key, and a position hashes to the
+ * XOR of the keys of all its pieces, plus a key for light to move. XOR makes
+ * the hash cheap to update after a move: the new piece adds its key, and each
+ * flipped piece swaps its key for the other color's, which is a single XOR
+ * with a precomputed key per square (see zobrist_move).
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "bits.hh"
+#include "board.hh"
+#include "player.hh"
+#include "prng.hh"
+
+namespace Othello {
+
+struct ZobristKeys {
+  uint64_t dark_[N2];   // Dark piece on each square
+  uint64_t light_[N2];  // Light piece on each square
+  uint64_t flip_[N2];   // Piece on each square changing color: dark_ ^ light_
+  uint64_t turn_;       // Light to move
+};
+
+// Fixed keys, so hashes are reproducible across runs:
+constexpr ZobristKeys ZOBRIST = []() {
+  ZobristKeys keys{};
+  uint64_t seed = 0x2a0b17e11000;
+  for (unsigned i = 0; i < N2; ++i) {
+    keys.dark_[i] = splitmix64(seed);
+    keys.light_[i] = splitmix64(seed);
+    keys.flip_[i] = keys.dark_[i] ^ keys.light_[i];
+  }
+  keys.turn_ = splitmix64(seed);
+  return keys;
+}();
+
+// XOR of a per-square key over all the squares in a bitmap:
+constexpr uint64_t
+zobrist_keys(const uint64_t (&keys)[N2], bits_t squares)
+{
+  uint64_t hash = 0;
+  for (; squares; squares &= squares - 1) {
+    hash ^= keys[__builtin_ctzll(squares)];
+  }
+  return hash;
+}
+
+// Hash a position from scratch:
+constexpr uint64_t
+zobrist_hash(Board board, Color turn)
+{
+  return zobrist_keys(ZOBRIST.dark_, board.dark())
+       ^ zobrist_keys(ZOBRIST.light_, board.light())
+       ^ ((turn == Color::LIGHT)? ZOBRIST.turn_ : 0);
+}
+
+// Update a position's hash after player curp moves at pos, flipping `flipped`
+// (and passing the turn to the opponent):
+constexpr uint64_t
+zobrist_move(uint64_t hash, Color curp, bits_t pos, bits_t flipped)
+{
+  const auto& placed = (curp == Color::DARK)? ZOBRIST.dark_ : ZOBRIST.light_;
+  return hash ^ placed[__builtin_ctzll(pos)] ^ zobrist_keys(ZOBRIST.flip_, flipped) ^ ZOBRIST.turn_;
+}
+
+// Update a position's hash after player to move passes:
+constexpr uint64_t zobrist_pass(uint64_t hash) { return hash ^ ZOBRIST.turn_; }
+
+} // namespace